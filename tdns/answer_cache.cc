@@ -0,0 +1,127 @@
+#include "answer_cache.hh"
+
+using namespace std;
+
+AnswerCache g_answercache;
+
+AnswerCache::Status AnswerCache::get(const DNSName& dn, DNSType dt, DNSMessageWriter& dmw)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_cache.find({dn, dt});
+  time_t now = time(nullptr);
+  if(iter == d_cache.end() || now - iter->second.inserted >= iter->second.ttl) {
+    d_misses++;
+    return Status::Miss;
+  }
+  auto& entry = iter->second;
+  uint32_t age = now - entry.inserted;
+
+  for(const auto& part : {&entry.res.intermediate, &entry.res.res}) // CNAME chain first
+    for(const auto& rr : *part)
+      dmw.putRR(DNSSection::Answer, rr.name, rr.ttl > age ? rr.ttl - age : 0, rr.rr);
+
+  d_hits++;
+  entry.hits++;
+  touch(entry);
+  uint32_t left = entry.ttl - age;
+  if(!entry.prefetching && entry.hits >= d_prefetchhits && left * 100 <= (uint64_t)entry.ttl * d_prefetchpct) {
+    entry.prefetching = true;
+    d_prefetches++;
+    return Status::HitNeedsPrefetch;
+  }
+  return Status::Hit;
+}
+
+void AnswerCache::store(const DNSName& dn, DNSType dt, TDNSResolver::ResolveResult&& res)
+{
+  if(res.res.empty())
+    return;
+  Entry entry;
+  entry.inserted = time(nullptr);
+  entry.ttl = std::numeric_limits<uint32_t>::max();
+  for(const auto& part : {&res.intermediate, &res.res})
+    for(const auto& rr : *part)
+      entry.ttl = std::min(entry.ttl, rr.ttl);
+  entry.res = std::move(res);
+
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_cache.find({dn, dt});
+  if(iter != d_cache.end()) { // a refresh, keeps its place in d_lru
+    entry.lru = iter->second.lru;
+    iter->second = std::move(entry);
+    touch(iter->second);
+    return;
+  }
+  // expired entries are not used anymore, so they end up at the back, where we drop them. If there
+  // are none, we make room by dropping the least recently used entry
+  while(!d_lru.empty()) {
+    auto tail = d_cache.find(d_lru.back());
+    if(d_cache.size() < d_maxentries && !expired(tail->second, entry.inserted))
+      break;
+    d_cache.erase(tail);
+    d_lru.pop_back();
+  }
+  d_lru.push_front({dn, dt});
+  entry.lru = d_lru.begin();
+  d_cache.emplace(d_lru.front(), std::move(entry));
+}
+
+//! Marks entry as the most recently used, called with the lock held
+void AnswerCache::touch(Entry& entry)
+{
+  d_lru.splice(d_lru.begin(), d_lru, entry.lru);
+}
+
+void AnswerCache::prefetchFailed(const DNSName& dn, DNSType dt)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_cache.find({dn, dt});
+  if(iter != d_cache.end())
+    iter->second.prefetching = false;
+}
+
+bool AnswerCache::getStale(const DNSName& dn, DNSType dt, DNSMessageWriter& dmw)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_cache.find({dn, dt});
+  if(iter == d_cache.end() || expired(iter->second, time(nullptr)))
+    return false;
+  putStale(iter->second, dmw);
+  return true;
+}
+
+void AnswerCache::refreshFailed(const DNSName& dn, DNSType dt)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_cache.find({dn, dt});
+  if(iter != d_cache.end())
+    iter->second.refreshfailed = time(nullptr);
+}
+
+bool AnswerCache::getStaleFailed(const DNSName& dn, DNSType dt, DNSMessageWriter& dmw)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter = d_cache.find({dn, dt});
+  time_t now = time(nullptr);
+  if(iter == d_cache.end() || expired(iter->second, now) || now - iter->second.refreshfailed >= d_stalerecheck)
+    return false;
+  putStale(iter->second, dmw);
+  return true;
+}
+
+//! Puts entry in dmw as a stale answer, called with the lock held
+void AnswerCache::putStale(Entry& entry, DNSMessageWriter& dmw)
+{
+  dmw.clearRRs(); // there might be a partial answer in there
+  for(const auto& part : {&entry.res.intermediate, &entry.res.res})
+    for(const auto& rr : *part)
+      dmw.putRR(DNSSection::Answer, rr.name, std::min(rr.ttl, d_stalettl), rr.rr);
+  d_stalehits++;
+  touch(entry);
+}
+
+//! Is entry expired, including being stale past its window?
+bool AnswerCache::expired(const Entry& entry, time_t now) const
+{
+  return now - entry.inserted >= (time_t)entry.ttl + d_stalewindow;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <ctime>
+#include "record-types.hh"
+#include "tres.hh"
+
+/*!
+   @file
+   @brief The answer cache of tres
+
+   Answers that tres resolved for its clients are stored here, keyed on name and type,
+   so the next client asking gets them without any queries going out. Every entry counts
+   how often it was used. If an entry is still popular near the end of its TTL, it is
+   refreshed in the background, so that clients never have to wait for a full resolution
+   of popular names.
+
+   Optionally, expired entries are kept for a while. If resolving a name fails, or takes
+   too long, such a stale answer is better than no answer at all (RFC 8767). After a failed
+   refresh, the stale answer is served right away for d_stalerecheck seconds, without trying
+   again (the failure recheck timer of RFC 8767).
+
+   Expired entries are dropped once they are the least recently used. When the cache is full
+   and nothing has expired, the least recently used entry goes.
+*/
+
+class AnswerCache
+{
+public:
+  enum class Status { Miss, Hit, HitNeedsPrefetch };
+
+  /** Puts the cached answer for dn|dt into dmw, with TTLs lowered by the time it spent in the cache.
+      HitNeedsPrefetch means it is time to refresh this entry, and the caller should do so.
+      Only one caller gets this until the entry has been refreshed */
+  Status get(const DNSName& dn, DNSType dt, DNSMessageWriter& dmw);
+  //! Stores a fresh answer, which resets the hit count
+  void store(const DNSName& dn, DNSType dt, TDNSResolver::ResolveResult&& res);
+  //! A refresh failed, allow a new attempt
+  void prefetchFailed(const DNSName& dn, DNSType dt);
+  //! Puts an expired answer in dmw, with d_stalettl as TTL, if it has not been expired for longer than d_stalewindow
+  bool getStale(const DNSName& dn, DNSType dt, DNSMessageWriter& dmw);
+  //! Refreshing an expired answer failed, so getStaleFailed serves it for the next d_stalerecheck seconds
+  void refreshFailed(const DNSName& dn, DNSType dt);
+  //! Like getStale, but only if refreshing the answer failed less than d_stalerecheck seconds ago
+  bool getStaleFailed(const DNSName& dn, DNSType dt, DNSMessageWriter& dmw);
+
+  size_t d_maxentries{100000};
+  unsigned int d_prefetchhits{3};  //!< prefetch entries with at least this many hits
+  unsigned int d_prefetchpct{10};  //!< in the last 10% of their TTL
+  uint32_t d_stalewindow{0};       //!< serve-stale: keep expired entries this long, 0 is off
+  uint32_t d_stalettl{30};         //!< and give them this TTL when we serve them
+  uint32_t d_stalerecheck{30};     //!< don't try to refresh them this long after a failure
+
+  //! statistics
+  uint64_t d_hits{0}, d_misses{0}, d_prefetches{0}, d_stalehits{0};
+
+private:
+  struct Entry
+  {
+    TDNSResolver::ResolveResult res;
+    time_t inserted;
+    uint32_t ttl; //!< the lowest TTL of all records in res
+    unsigned int hits{0};
+    bool prefetching{false};
+    time_t refreshfailed{0}; //!< when a refresh of this expired entry last failed
+    std::list<std::pair<DNSName, DNSType>>::iterator lru; //!< where we are in d_lru
+  };
+  typedef std::pair<DNSName, DNSType> key_t;
+  bool expired(const Entry& entry, time_t now) const;
+  void putStale(Entry& entry, DNSMessageWriter& dmw);
+  void touch(Entry& entry);
+
+  std::mutex d_lock;
+  std::map<key_t, Entry> d_cache;
+  std::list<key_t> d_lru; //!< the keys of d_cache, most recently used first
+};
+
+extern AnswerCache g_answercache;
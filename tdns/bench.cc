@@ -0,0 +1,308 @@
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <string.h>
+#include "dnsmessages.hh"
+#include "dns-storage.hh"
+#include "record-types.hh"
+#include "tdnssec.hh"
+
+/*!
+   @file
+   @brief Microbenchmarks for the hot paths of tdns
+
+   Run with 'make bench'. The results are printed as JSON, so the output of two
+   commits can be compared. All data is generated from a fixed seed, so every
+   run measures the same work. Each benchmark is calibrated to run for about
+   100 milliseconds per sample, and we report the median of 5 samples.
+
+   Note that the Makefile builds with -O0 by default, which is recorded in the
+   output. Only compare runs built with the same flags.
+*/
+
+using namespace std;
+
+namespace {
+
+//! Makes sure the compiler can't optimize away the computation of x
+template<typename T>
+void doNotOptimize(const T& x)
+{
+  asm volatile("" : : "g"(&x) : "memory");
+}
+
+struct Benchmark
+{
+  string name;
+  std::function<void(uint64_t)> run; //!< does the operation this many times
+};
+
+struct Result
+{
+  string name;
+  double nsPerOp;
+  uint64_t iterations; //!< per sample
+};
+
+Result measure(const Benchmark& b)
+{
+  auto time = [&b](uint64_t n) {
+    auto start = chrono::steady_clock::now();
+    b.run(n);
+    return chrono::duration<double, std::nano>(chrono::steady_clock::now() - start).count();
+  };
+
+  uint64_t n = 1;
+  double ns;
+  while((ns = time(n)) < 10000000.0) // 10ms
+    n *= 2;
+  n = max<uint64_t>(1, n * (100000000.0 / ns)); // aim for 100ms per sample
+
+  vector<double> samples;
+  for(int i = 0; i < 5; ++i)
+    samples.push_back(time(n) / n);
+  sort(samples.begin(), samples.end());
+  return {b.name, samples[samples.size()/2], n};
+}
+
+//! Synthetic names, shaped like host1234.sub56.example.com
+vector<DNSName> makeNames(size_t count, std::mt19937& gen)
+{
+  vector<DNSName> ret;
+  std::uniform_int_distribution<int> hosts(0, 99999), subs(0, 99);
+  for(size_t n = 0; n < count; ++n)
+    ret.push_back({"host"+to_string(hosts(gen)), "sub"+to_string(subs(gen)), "example", "com"});
+  return ret;
+}
+
+//! A referral from the root to com, shaped like the real thing: 13 NS records, with IPv4 and IPv6 glue
+void writeReferral(DNSMessageWriter& dmw)
+{
+  for(char c = 'a'; c <= 'm'; ++c)
+    dmw.putRR(DNSSection::Authority, {"com"}, 172800, NSGen::make({string(1, c)+"-gtld-servers", "net"}));
+  for(char c = 'a'; c <= 'm'; ++c) {
+    dmw.putRR(DNSSection::Additional, {string(1, c)+"-gtld-servers", "net"}, 172800, AGen::make(ComboAddress("192.5.6."+to_string(c))));
+    dmw.putRR(DNSSection::Additional, {string(1, c)+"-gtld-servers", "net"}, 172800, AAAAGen::make(ComboAddress("2001:503::"+to_string(c))));
+  }
+}
+
+//! A typical answer: a CNAME, two A records and an SOA
+void writeAnswer(DNSMessageWriter& dmw)
+{
+  dmw.putRR(DNSSection::Answer, {"www", "example", "com"}, 3600, CNAMEGen::make({"www", "example", "net"}));
+  dmw.putRR(DNSSection::Answer, {"www", "example", "net"}, 300, AGen::make(ComboAddress("192.0.2.1")));
+  dmw.putRR(DNSSection::Answer, {"www", "example", "net"}, 300, AGen::make(ComboAddress("192.0.2.2")));
+  dmw.putRR(DNSSection::Authority, {"example", "net"}, 3600, SOAGen::make({"ns1", "example", "net"}, {"admin", "example", "net"}, 2018100101));
+}
+
+void parse(const string& packet)
+{
+  DNSMessageReader dmr(packet);
+  DNSSection rrsection;
+  DNSName rrdn;
+  DNSType rrdt;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr))
+    doNotOptimize(rr);
+}
+
+vector<Benchmark> makeBenchmarks()
+{
+  vector<Benchmark> ret;
+  std::mt19937 gen(42);
+
+  auto names = std::make_shared<vector<DNSName>>(makeNames(1024, gen));
+  auto strings = std::make_shared<vector<string>>();
+  for(const auto& n : *names)
+    strings->push_back(n.toString());
+
+  ret.push_back({"dnsname/make", [strings](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSName dn = makeDNSName((*strings)[i % strings->size()]);
+      doNotOptimize(dn);
+    }
+  }});
+  ret.push_back({"dnsname/copy", [names](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSName dn = (*names)[i % names->size()];
+      doNotOptimize(dn);
+    }
+  }});
+  ret.push_back({"dnsname/less", [names](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      bool res = (*names)[i % names->size()] < (*names)[(i + 1) % names->size()];
+      doNotOptimize(res);
+    }
+  }});
+  ret.push_back({"dnsname/canon-compare", [names](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      bool res = (*names)[i % names->size()].canonCompare((*names)[(i + 1) % names->size()]);
+      doNotOptimize(res);
+    }
+  }});
+  ret.push_back({"dnsname/is-part-of", [names](uint64_t n) {
+    DNSName zone({"example", "com"});
+    for(uint64_t i = 0; i < n; ++i) {
+      bool res = (*names)[i % names->size()].isPartOf(zone);
+      doNotOptimize(res);
+    }
+  }});
+
+  ret.push_back({"enum/to-string", [](uint64_t n) {
+    static const DNSType types[] = {DNSType::A, DNSType::AAAA, DNSType::MX, DNSType::CAA};
+    for(uint64_t i = 0; i < n; ++i) {
+      const char* str = toString(types[i % 4]);
+      doNotOptimize(str);
+    }
+  }});
+  ret.push_back({"enum/make", [](uint64_t n) {
+    static const char* names[] = {"A", "AAAA", "MX", "CAA"};
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSType t = makeDNSType(names[i % 4]);
+      doNotOptimize(t);
+    }
+  }});
+
+  // what every NSEC3 NXDOMAIN answer needs three of, RFC 9276 recommends no extra iterations
+  ret.push_back({"dnssec/nsec3-hash", [names](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      string hash = hashNSEC3((*names)[i % names->size()], "", 0);
+      doNotOptimize(hash);
+    }
+  }});
+  ret.push_back({"dnssec/nsec3-hash-iterated", [names](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      string hash = hashNSEC3((*names)[i % names->size()], "\xaa\xbb\xcc\xdd", 10);
+      doNotOptimize(hash);
+    }
+  }});
+
+  // a zone with 10000 names under example.com, and a wildcard
+  auto tree = std::make_shared<DNSNode>();
+  auto zone = tree->add({"example", "com"});
+  zone->addRRs(SOAGen::make({"ns1", "example", "com"}, {"admin", "example", "com"}, 1));
+  for(auto dn : makeNames(10000, gen)) {
+    dn.makeRelative({"example", "com"});
+    zone->add(dn)->addRRs(AGen::make(ComboAddress("192.0.2.1")));
+  }
+  zone->add({"*", "sub1"})->addRRs(AGen::make(ComboAddress("192.0.2.2")));
+  auto hits = std::make_shared<vector<DNSName>>(makeNames(1024, gen));
+
+  ret.push_back({"dnsnode/find", [tree, hits](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSName dn = (*hits)[i % hits->size()], last;
+      auto node = tree->find(dn, last);
+      doNotOptimize(node);
+    }
+  }});
+  ret.push_back({"dnsnode/find-wildcard", [tree](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSName dn({"nosuchhost", "sub1", "example", "com"}), last;
+      const DNSNode* wildcard = nullptr;
+      auto node = tree->find(dn, last, true, nullptr, &wildcard);
+      doNotOptimize(node);
+    }
+  }});
+
+  ret.push_back({"writer/referral", [](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSMessageWriter dmw({"www", "example", "com"}, DNSType::A, DNSClass::IN, 1500);
+      writeReferral(dmw);
+      string packet = dmw.serialize();
+      doNotOptimize(packet);
+    }
+  }});
+  ret.push_back({"writer/answer", [](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSMessageWriter dmw({"www", "example", "com"}, DNSType::A);
+      writeAnswer(dmw);
+      string packet = dmw.serialize();
+      doNotOptimize(packet);
+    }
+  }});
+
+  // the same answer, but from RRSets, as tauth writes it
+  auto rrsets = std::make_shared<vector<RRSet>>(3);
+  (*rrsets)[0].add(CNAMEGen::make({"www", "example", "net"}));
+  (*rrsets)[1].add(AGen::make(ComboAddress("192.0.2.1")));
+  (*rrsets)[1].add(AGen::make(ComboAddress("192.0.2.2")));
+  (*rrsets)[2].add(SOAGen::make({"ns1", "example", "net"}, {"admin", "example", "net"}, 2018100101));
+  ret.push_back({"writer/answer-rrset", [rrsets](uint64_t n) {
+    DNSName www({"www", "example", "com"}), wwwnet({"www", "example", "net"}), zone({"example", "net"});
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSMessageWriter dmw(www, DNSType::A);
+      dmw.putRR(DNSSection::Answer, www, 3600, (*rrsets)[0].contents[0]);
+      for(const auto& rr : (*rrsets)[1].contents)
+        dmw.putRR(DNSSection::Answer, wwwnet, 300, rr);
+      dmw.putRR(DNSSection::Authority, zone, 3600, (*rrsets)[2].contents[0]);
+      string packet = dmw.serialize();
+      doNotOptimize(packet);
+    }
+  }});
+
+  DNSMessageWriter referral({"www", "example", "com"}, DNSType::A, DNSClass::IN, 1500);
+  writeReferral(referral);
+  auto referralPacket = std::make_shared<string>(referral.serialize());
+  DNSMessageWriter answer({"www", "example", "com"}, DNSType::A);
+  writeAnswer(answer);
+  auto answerPacket = std::make_shared<string>(answer.serialize());
+
+  ret.push_back({"reader/referral", [referralPacket](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i)
+      parse(*referralPacket);
+  }});
+  ret.push_back({"reader/answer", [answerPacket](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i)
+      parse(*answerPacket);
+  }});
+  // what tdns-c does: only decode the A records in the answer section
+  ret.push_back({"reader/answer-view", [answerPacket](uint64_t n) {
+    for(uint64_t i = 0; i < n; ++i) {
+      DNSMessageReader dmr(*answerPacket);
+      DNSMessageReader::RRView rr;
+      while(dmr.getRR(rr))
+        if(rr.section == DNSSection::Answer && rr.type == DNSType::A)
+          doNotOptimize(dmr.getContent(rr));
+    }
+  }});
+  return ret;
+}
+}
+
+int main(int argc, char** argv)
+try
+{
+  if(argc > 2) {
+    cerr<<"Syntax: microbench [filter]"<<endl;
+    cerr<<"Runs the benchmarks with 'filter' in their name, or all of them"<<endl;
+    return EXIT_FAILURE;
+  }
+  string filter = argc == 2 ? argv[1] : "";
+
+#ifdef __OPTIMIZE__
+  bool optimized = true;
+#else
+  bool optimized = false;
+#endif
+  cout<<"{\n  \"context\": {\"compiler\": \""<<__VERSION__<<"\", \"optimized\": "<<(optimized ? "true" : "false")<<"},\n";
+  cout<<"  \"benchmarks\": [";
+  bool first = true;
+  for(const auto& b : makeBenchmarks()) {
+    if(b.name.find(filter) == string::npos)
+      continue;
+    auto res = measure(b);
+    cout<<(first ? "\n" : ",\n");
+    cout<<"    {\"name\": \""<<res.name<<"\", \"ns_per_op\": "<<res.nsPerOp<<", \"ops_per_sec\": "<<(uint64_t)(1000000000.0 / res.nsPerOp);
+    cout<<", \"iterations\": "<<res.iterations<<"}"<<flush;
+    first = false;
+  }
+  cout<<"\n  ]\n}"<<endl;
+}
+catch(std::exception& e)
+{
+  cerr<<"Fatal error: "<<e.what()<<endl;
+  return EXIT_FAILURE;
+}
@@ -1,6 +1,9 @@
 #include "dns-storage.hh"
 #include "record-types.hh"
 #include "sclasses.hh"
+#include "tdnssec.hh"
+#include <algorithm>
+#include <ctime>
 using namespace std;
 
 /*! 
@@ -88,6 +91,139 @@ void loadZones(DNSNode& zones)
   zones.add({"powerdns", "org"})->zone=retrieveZone(ComboAddress("52.48.64.3", 53), {"powerdns", "org"});
 }
 
+/* Names in the generated zone come in kinds, and there are equally many of each:
+   hostN with A, AAAA and MX records, CNAME chains wwwN -> aliasN -> hostN, delegations
+   to subN with glue, and wildcards *.wildN.
+
+   Every RRSet, except those at and below delegations, gets an RRSIG, and all names are
+   linked by NSEC records. The signatures are random bytes, which is fine for measuring
+   how fast we serve them, but nothing will validate them */
+void generateZone(DNSNode& zones, const DNSName& zonename, unsigned int size, bool nsec3, uint16_t iterations)
+{
+  auto newzone = std::make_unique<DNSNode>();
+  vector<pair<DNSName, DNSNode*>> signednodes; // relative names
+
+  newzone->addRRs(SOAGen::make(DNSName({"ns1"}) + zonename, DNSName({"admin"}) + zonename, 1),
+                  NSGen::make(DNSName({"ns1"}) + zonename), NSGen::make(DNSName({"ns2"}) + zonename));
+  signednodes.push_back({{}, newzone.get()});
+  for(const auto& ns : {"ns1", "ns2"}) {
+    auto node = newzone->add({ns});
+    node->addRRs(AGen::make("192.0.2.53"), AAAAGen::make("2001:db8::53"));
+    signednodes.push_back({{ns}, node});
+  }
+
+  for(unsigned int n = 0; n * 6 < size; ++n) { // 6 names per round
+    string num = to_string(n);
+    auto host = newzone->add({"host"+num});
+    host->addRRs(AGen::make("192.0.2.1"), AAAAGen::make("2001:db8::1"), MXGen::make(10, DNSName({"host"+num}) + zonename));
+    signednodes.push_back({{"host"+num}, host});
+
+    auto alias = newzone->add({"alias"+num});
+    alias->addRRs(CNAMEGen::make(DNSName({"host"+num}) + zonename));
+    signednodes.push_back({{"alias"+num}, alias});
+    auto www = newzone->add({"www"+num});
+    www->addRRs(CNAMEGen::make(DNSName({"alias"+num}) + zonename));
+    signednodes.push_back({{"www"+num}, www});
+
+    auto sub = newzone->add({"sub"+num});
+    sub->addRRs(NSGen::make(DNSName({"ns1", "sub"+num}) + zonename), NSGen::make(DNSName({"ns2", "sub"+num}) + zonename));
+    sub->add({"ns1"})->addRRs(AGen::make("192.0.2.2"));
+    sub->add({"ns2"})->addRRs(AGen::make("192.0.2.3"));
+    signednodes.push_back({{"sub"+num}, sub});
+
+    auto wild = newzone->add({"wild"+num});
+    wild->addRRs(TXTGen::make({"there is a wildcard below this name"}));
+    signednodes.push_back({{"wild"+num}, wild});
+    auto star = wild->add({"*"});
+    star->addRRs(AGen::make("192.0.2.4"));
+    signednodes.push_back({{"*", "wild"+num}, star});
+  }
+
+  sort(signednodes.begin(), signednodes.end(), [](const pair<DNSName, DNSNode*>& a, const pair<DNSName, DNSNode*>& b) {
+      return a.first.canonCompare(b.first);
+    });
+
+  string signature;
+  for(int n = 0; n < 64; ++n)
+    signature.append(1, (char)random());
+  uint32_t now = time(nullptr);
+  uint8_t zonelabels = zonename.d_name.size();
+
+  if(nsec3) { // the NSEC3 records get their own nodes just below the apex, named after the hash
+    vector<pair<string, DNSNode*>> hashed;
+    for(const auto& sn : signednodes)
+      hashed.push_back({hashNSEC3(sn.first + zonename, "", iterations), sn.second});
+    sort(hashed.begin(), hashed.end());
+    for(size_t n = 0; n < hashed.size(); ++n) {
+      auto node = hashed[n].second;
+      set<DNSType> types;
+      for(const auto& rrset : node->rrsets)
+        types.insert(rrset.first);
+      if(node == newzone.get() || !node->rrsets.count(DNSType::NS)) // a delegation has no signatures
+        types.insert(DNSType::RRSIG);
+      auto hashnode = newzone->add({toBase32Hex(hashed[n].first)});
+      hashnode->addRRs(NSEC3Gen::make(iterations, "", hashed[(n + 1) % hashed.size()].first, types));
+      hashnode->rrsets[DNSType::NSEC3].signatures.add(std::make_unique<RRSIGGen>(DNSType::NSEC3, 12345, zonename, signature, 3600,
+                                                                                now + 86400*30, now - 3600, 13, zonelabels + 1));
+    }
+  }
+
+  for(size_t n = 0; n < signednodes.size(); ++n) {
+    auto node = signednodes[n].second;
+    bool delegation = n && node->rrsets.count(DNSType::NS);
+    if(!nsec3) {
+      set<DNSType> types{DNSType::NSEC, DNSType::RRSIG};
+      for(const auto& rrset : node->rrsets)
+        types.insert(rrset.first);
+      node->addRRs(NSECGen::make(signednodes[(n + 1) % signednodes.size()].first + zonename, types));
+    }
+
+    const auto& owner = signednodes[n].first;
+    uint8_t labels = zonelabels + owner.d_name.size() - (!owner.empty() && owner.front() == DNSLabel("*"));
+    for(auto& rrset : node->rrsets) {
+      if(delegation && rrset.first == DNSType::NS)
+        continue;
+      rrset.second.signatures.add(std::make_unique<RRSIGGen>(rrset.first, 12345, zonename, signature, rrset.second.ttl,
+                                                                   now + 86400*30, now - 3600, 13, labels));
+    }
+  }
+
+  zones.add(zonename)->zone = std::move(newzone);
+}
+
+//! An A or AAAA record for ca
+static std::unique_ptr<RRGen> addressRecord(const ComboAddress& ca)
+{
+  if(ca.sin4.sin_family == AF_INET)
+    return AGen::make(ca);
+  return AAAAGen::make(ca);
+}
+
+/* The zone gets nameservers ns1 and ns2.zonename at address 'self'. Each child is delegated
+   to ns1 and ns2 within the child zone, with the child address as glue. With a root that
+   delegates 'example', and an 'example' that delegates 'bench.example', this makes a
+   hierarchy on top of generateZone() that a resolver can be pointed at */
+void generateDelegations(DNSNode& zones, const DNSName& zonename, const ComboAddress& self,
+                         const vector<pair<DNSName, ComboAddress>>& children)
+{
+  auto newzone = std::make_unique<DNSNode>();
+  newzone->addRRs(SOAGen::make(DNSName({"ns1"}) + zonename, DNSName({"admin"}) + zonename, 1),
+                  NSGen::make(DNSName({"ns1"}) + zonename), NSGen::make(DNSName({"ns2"}) + zonename));
+  for(const auto& ns : {"ns1", "ns2"})
+    newzone->add({ns})->addRRs(addressRecord(self));
+
+  for(const auto& child : children) {
+    DNSName rel(child.first);
+    if(!rel.makeRelative(zonename) || rel.empty())
+      throw std::runtime_error("Can't delegate "+child.first.toString()+" from zone "+zonename.toString());
+    auto cut = newzone->add(rel);
+    cut->addRRs(NSGen::make(DNSName({"ns1"}) + child.first), NSGen::make(DNSName({"ns2"}) + child.first));
+    for(const auto& ns : {"ns1", "ns2"})
+      cut->add({ns})->addRRs(addressRecord(child.second));
+  }
+  zones.add(zonename)->zone = std::move(newzone);
+}
+
 void reportQuery(DNSName qname, DNSClass qclass, DNSType qtype, const ComboAddress& remote)
 {
 }
@@ -21,6 +21,23 @@ bool DNSName::makeRelative(const DNSName& root)
   return true;
 }
 
+//! Labels are compared as lowercase octet strings, and the root is the smallest name of all
+bool DNSName::canonCompare(const DNSName& rhs) const
+{
+  auto lower = [](char c) { return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + 0x20) : (unsigned char)c; };
+  auto us = d_name.crbegin(), them = rhs.d_name.crbegin();
+  for(; us != d_name.crend() && them != rhs.d_name.crend(); ++us, ++them) {
+    const auto& a = us->d_s;
+    const auto& b = them->d_s;
+    auto res = std::mismatch(a.begin(), a.end(), b.begin(), b.end(), [&lower](char x, char y) { return lower(x) == lower(y); });
+    if(res.first != a.end() && res.second != b.end())
+      return lower(*res.first) < lower(*res.second);
+    if(a.size() != b.size())
+      return a.size() < b.size();
+  }
+  return us == d_name.crend() && them != rhs.d_name.crend();
+}
+
 //! Checks is this DNSName is part of root
 bool DNSName::isPartOf(const DNSName& root) const
 {
@@ -191,6 +208,52 @@ void DNSNode::addRRs(std::unique_ptr<RRGen>&&a)
     rrsets[a->getType()].add(std::move(a));
 }
 
+const DNSName* getTarget(const RRRef& rr)
+{
+  switch(rr.list->getType()) {
+  case DNSType::NS:
+    return &rr.get<NSGen>()->d_name;
+  case DNSType::MX:
+    return &rr.get<MXGen>()->d_name;
+  case DNSType::SRV:
+    return &rr.get<SRVGen>()->d_target;
+  default:
+    return 0;
+  }
+}
+
+//! Links the targets of all NS, MX and SRV records within the zone 'apex' called 'zonename'
+static void linkZoneTargets(const DNSNode* apex, const DNSName& zonename, const DNSNode* node)
+{
+  for(const auto& rrsets : node->rrsets) {
+    auto& rrset = const_cast<RRSet&>(rrsets.second); // sorry
+    rrset.targets.clear();
+    for(const auto& rr : rrset.contents) {
+      auto target = getTarget(rr);
+      if(!target)
+        break;
+      DNSName addname(*target), last;
+      const DNSNode* addnode = 0;
+      if(addname.makeRelative(zonename)) {
+        addnode = apex->find(addname, last);
+        if(!addname.empty() || (!addnode->rrsets.count(DNSType::A) && !addnode->rrsets.count(DNSType::AAAA)))
+          addnode = 0;
+      }
+      rrset.targets.push_back(addnode);
+    }
+  }
+  for(const auto& child : node->children)
+    linkZoneTargets(apex, zonename, &child);
+}
+
+void linkTargets(DNSNode& zones)
+{
+  if(zones.zone)
+    linkZoneTargets(zones.zone.get(), zones.getName(), zones.zone.get());
+  for(const auto& child : zones.children)
+    linkTargets(const_cast<DNSNode&>(child));
+}
+
 // Emit an escaped DNSLabel in 'master file' format
 std::ostream & operator<<(std::ostream &os, const DNSLabel& d)
 {
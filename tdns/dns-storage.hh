@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <typeinfo>
 #include "nenum.hh"
 #include "comboaddress.hh"
 
@@ -143,10 +144,12 @@ struct DNSName
   void pop_back() { d_name.pop_back(); }
   void pop_front() { d_name.pop_front(); }
   auto push_front(const DNSLabel& dn) { return d_name.push_front(dn); }
-  auto size() { return d_name.size(); }
+  auto size() const { return d_name.size(); }
   void clear() { d_name.clear(); }
   bool makeRelative(const DNSName& root);
   bool isPartOf(const DNSName& root) const;
+  //! DNSSEC canonical ordering (RFC 4034, 6.1), which compares names label by label from the root down
+  bool canonCompare(const DNSName& rhs) const;
   std::string toString() const;
   bool operator==(const DNSName& rhs) const
   {
@@ -185,21 +188,122 @@ struct RRGen
   virtual ~RRGen();
 };
 
+//! Type erased storage of an RRList, see record-types.cc
+struct RRStorage
+{
+  virtual ~RRStorage() {}
+  //! Moves all records to the heap, and appends pointers to them to 'to'
+  virtual void release(std::vector<std::unique_ptr<RRGen>>& to) = 0;
+};
+
+class RRList;
+
+//! Refers to a record in an RRList, and can be used like a pointer to an RRGen
+struct RRRef
+{
+  const RRList* list;
+  size_t n;
+  const RRGen& operator*() const;
+  const RRGen* operator->() const { return &**this; }
+  //! Like dynamic_cast<const T*>, but without RTTI for records stored by value
+  template<typename T> const T* get() const;
+};
+
+/*! The records of an RRSet. These all have the same type, and are nearly always of the same
+    RRGen subclass, like AGen. Such records are stored by value, next to each other, in a
+    single allocation. Since we then know their class, writing them to a DNSMessageWriter
+    needs no virtual calls, and RRRef::get() needs no dynamic_cast.
+
+    If a record of another class comes along, like a ClockTXTGen next to a TXTGen, the list
+    falls back to storing a pointer to each record */
+class RRList
+{
+public:
+  void add(std::unique_ptr<RRGen>&& rr);
+  size_t size() const { return d_size; }
+  bool empty() const { return !d_size; }
+  RRRef operator[](size_t n) const { return {this, n}; }
+  DNSType getType() const { return d_type; }
+
+  const RRGen& at(size_t n) const
+  {
+    if(d_storage)
+      return *reinterpret_cast<const RRGen*>(d_base + n * d_stride);
+    return *d_pointers[n];
+  }
+  template<typename T> const T* get(size_t n) const
+  {
+    if(d_storage)
+      return *d_class == typeid(T) ? reinterpret_cast<const T*>(d_data + n * d_stride) : nullptr;
+    return dynamic_cast<const T*>(d_pointers[n].get());
+  }
+  //! Writes the content of record n, as RRGen::toMessage() would
+  void toMessage(size_t n, DNSMessageWriter& dmw) const;
+
+  struct iterator
+  {
+    RRRef operator*() const { return {list, n}; }
+    iterator& operator++() { ++n; return *this; }
+    bool operator!=(const iterator& rhs) const { return n != rhs.n; }
+    const RRList* list;
+    size_t n;
+  };
+  iterator begin() const { return {this, 0}; }
+  iterator end() const { return {this, d_size}; }
+
+private:
+  template<typename T> bool addByValue(std::unique_ptr<RRGen>& rr);
+
+  std::unique_ptr<RRStorage> d_storage;             //!< records stored by value, if we can
+  std::vector<std::unique_ptr<RRGen>> d_pointers;   //!< if we can't
+  const std::type_info* d_class{nullptr};           //!< the class of the records in d_storage
+  const char* d_data{nullptr};                      //!< the first record in d_storage
+  const char* d_base{nullptr};                      //!< the RRGen within that first record
+  size_t d_stride{0};
+  size_t d_size{0};
+  DNSType d_type{(DNSType)0};
+};
+
+inline const RRGen& RRRef::operator*() const
+{
+  return list->at(n);
+}
+
+template<typename T> const T* RRRef::get() const
+{
+  return list->template get<T>(n);
+}
+
+struct DNSNode;
+
 //! Resource records are treated as a set and have one TTL for the whole set
 struct RRSet
 {
-  std::vector<std::unique_ptr<RRGen>> contents;
-  std::vector<std::unique_ptr<RRGen>> signatures;
+  RRList contents;
+  RRList signatures;
+  //! For NS, MX and SRV, the in-zone node with addresses each record points to, or 0. Set by linkTargets()
+  std::vector<const DNSNode*> targets;
   void add(std::unique_ptr<RRGen>&& rr)
   {
     if(rr->getType() != DNSType::RRSIG)
-      contents.emplace_back(std::move(rr));
+      contents.add(std::move(rr));
     else
-      signatures.emplace_back(std::move(rr));
+      signatures.add(std::move(rr));
   }
   uint32_t ttl{3600};
 };
 
+//! Lookup structures for the DNSSEC records of a signed zone, built by indexDNSSEC() when it is loaded
+struct DNSSECIndex
+{
+  //! The nodes that have an NSEC record, with their names relative to the zone, in canonical order
+  std::vector<std::pair<DNSName, const DNSNode*>> nsecs;
+  //! For NSEC3 zones, the nodes that have an NSEC3 record, by the hash in their name, in order
+  std::vector<std::pair<std::string, const DNSNode*>> nsec3s;
+  std::string nsec3salt;       //!< the salt of the NSEC3 records
+  uint16_t nsec3iterations{0}; //!< the extra iterations of the NSEC3 hash
+};
+
 //! A node in the DNS tree
 struct DNSNode
 {
@@ -261,10 +365,21 @@ struct DNSNode
   // !the RRSets, grouped by type
   std::map<DNSType, RRSet > rrsets;
   std::unique_ptr<DNSNode> zone; //!< if this is set, this node is a zone
+  std::unique_ptr<DNSSECIndex> dnssec; //!< if this is set, this node is the apex of a signed zone
   uint16_t namepos{0}; //!< for label compression, we also use DNSNodes
 };
 
 //! Called by main() to load zone information
 void loadZones(DNSNode& zones);
+//! Generates a DNSSEC signed zone with about 'size' names, for benchmarking. Uses NSEC3 with 'iterations' if 'nsec3' is set
+void generateZone(DNSNode& zones, const DNSName& zonename, unsigned int size, bool nsec3 = false, uint16_t iterations = 0);
+//! Generates a zone that only delegates to 'children', to simulate a level of the DNS hierarchy
+void generateDelegations(DNSNode& zones, const DNSName& zonename, const ComboAddress& self,
+                         const std::vector<std::pair<DNSName, ComboAddress>>& children);
+
+//! Fills out RRSet::targets for all zones in 'zones', so additional processing needs no lookups
+void linkTargets(DNSNode& zones);
+//! The name an NS, MX or SRV record points to, or 0 for other types
+const DNSName* getTarget(const RRRef& rr);
 
 std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName& zone);
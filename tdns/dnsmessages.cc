@@ -58,6 +58,23 @@ void DNSMessageReader::xfrName(DNSName& res, uint16_t* pos)
   }
 }
 
+void DNSMessageReader::skipName(uint16_t* pos)
+{
+  if(!pos) pos = &payloadpos;
+  for(;;) {
+    uint8_t labellen = getUInt8(pos);
+    if(labellen & 0xc0) { // compression pointer, which ends the name
+      getUInt8(pos);
+      return;
+    }
+    if(!labellen)
+      return;
+    *pos += labellen;
+    if(*pos >= payload.size())
+      throw std::out_of_range("label beyond end of packet");
+  }
+}
+
 void DNSMessageReader::getQuestion(DNSName& name, DNSType& type) const
 {
   name = d_qname; type = d_qtype;
@@ -75,7 +92,7 @@ bool DNSMessageReader::getEDNS(uint16_t* bufsize, bool* doBit) const
 void DNSMessageReader::skipRRs(int num)
 {
   for(int n = 0; n < num; ++n) {
-    getName();
+    skipName();
     payloadpos += 8; // type, class, ttl
     auto len = getUInt16();
     payloadpos += len;
@@ -84,36 +101,133 @@ void DNSMessageReader::skipRRs(int num)
   }
 }
 
-bool DNSMessageReader::getRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, std::unique_ptr<RRGen>& content)
+namespace {
+typedef std::unique_ptr<RRGen> (*RRDecoder)(DNSMessageReader& dmr);
+
+template<typename T>
+std::unique_ptr<RRGen> decode(DNSMessageReader& dmr)
+{
+  return std::make_unique<T>(dmr);
+}
+
+/* The types we can decode, indexed by type number. They all fit in 8 bits.
+   Everything else becomes an UnknownGen, this should care about RP, AFSDB
+   too (RFC3597).. if anyone cares */
+struct DecoderTable
+{
+  constexpr DecoderTable() : decoders{}
+  {
+#define DECODER(x) decoders[(uint16_t)DNSType::x] = decode<x##Gen>;
+    DECODER(A) DECODER(AAAA) DECODER(NS) DECODER(SOA) DECODER(MX) DECODER(CNAME)
+    DECODER(NAPTR) DECODER(SRV)
+    DECODER(TXT) DECODER(RRSIG) DECODER(NSEC) DECODER(NSEC3)
+    DECODER(PTR)
+#undef DECODER
+  }
+  RRDecoder get(DNSType type) const
+  {
+    return (uint16_t)type < 256 ? decoders[(uint16_t)type] : nullptr;
+  }
+  RRDecoder decoders[256];
+};
+
+constexpr DecoderTable g_decoders;
+
+bool equalsIgnoreCase(const uint8_t* a, const char* b, size_t len)
+{
+  for(size_t n = 0; n < len; ++n) {
+    uint8_t ca = a[n], cb = b[n];
+    if(ca >= 0x61 && ca <= 0x7A)
+      ca -= 0x20;
+    if(cb >= 0x61 && cb <= 0x7A)
+      cb -= 0x20;
+    if(ca != cb)
+      return false;
+  }
+  return true;
+}
+}
+
+bool DNSMessageReader::getRR(RRView& rr)
 {
   if(payloadpos == payload.size())
     return false;
   if(rrpos < ntohs(dh.ancount))
-    section = DNSSection::Answer;
+    rr.section = DNSSection::Answer;
   else if(rrpos < ntohs(dh.ancount) + ntohs(dh.nscount))
-    section = DNSSection::Authority;
+    rr.section = DNSSection::Authority;
   else
-    section = DNSSection::Additional;
+    rr.section = DNSSection::Additional;
   ++rrpos;
-  name = getName();
-  type=(DNSType)getUInt16();
-  /* uint16_t lclass = */ getUInt16(); // class
-  xfrUInt32(ttl);
-  auto len = getUInt16();
-  d_endofrecord = payloadpos + len;
-  // this should care about RP, AFSDB too (RFC3597).. if anyone cares
-#define CONVERT(x) if(type == DNSType::x) { content = std::make_unique<x##Gen>(*this);} else
-  CONVERT(A) CONVERT(AAAA) CONVERT(NS) CONVERT(SOA) CONVERT(MX) CONVERT(CNAME)
-  CONVERT(NAPTR) CONVERT(SRV)
-  CONVERT(TXT) CONVERT(RRSIG)
-  CONVERT(PTR) 
-  {
-    content = std::make_unique<UnknownGen>(type, getBlob(len));
-  }
-#undef CONVERT
+  rr.namepos = payloadpos;
+  skipName();
+  rr.type = (DNSType)getUInt16();
+  rr.dclass = (DNSClass)getUInt16();
+  xfrUInt32(rr.ttl);
+  rr.rdlength = getUInt16();
+  rr.rdatapos = payloadpos;
+  if(payloadpos + rr.rdlength > payload.size())
+    throw std::out_of_range("RR content beyond end of packet");
+  payloadpos += rr.rdlength;
+  d_endofrecord = payloadpos;
+  return true;
+}
+
+bool DNSMessageReader::getRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, std::unique_ptr<RRGen>& content)
+{
+  RRView rr;
+  if(!getRR(rr))
+    return false;
+  section = rr.section;
+  name = getOwner(rr);
+  type = rr.type;
+  ttl = rr.ttl;
+  content = getContent(rr);
   return true;
 }
 
+std::unique_ptr<RRGen> DNSMessageReader::getContent(const RRView& rr)
+{
+  auto nowpos = payloadpos;
+  payloadpos = rr.rdatapos;
+  d_endofrecord = rr.rdatapos + rr.rdlength;
+  std::unique_ptr<RRGen> ret;
+  if(auto decoder = g_decoders.get(rr.type))
+    ret = decoder(*this);
+  else
+    ret = std::make_unique<UnknownGen>(rr.type, getBlob(rr.rdlength));
+  payloadpos = nowpos;
+  return ret;
+}
+
+bool DNSMessageReader::ownerIs(const RRView& rr, const DNSName& name) const
+{
+  uint16_t pos = rr.namepos;
+  auto iter = name.begin();
+  for(;;) {
+    uint8_t labellen = payload.at(pos);
+    if(labellen & 0xc0) {
+      uint16_t newpos = ((labellen & ~0xc0) << 8) | payload.at(pos + 1);
+      newpos -= sizeof(dnsheader);
+      if(newpos >= pos) // only backwards, so we can't loop
+        throw std::runtime_error("forward compression: " + std::to_string(newpos) + " >= " + std::to_string(pos));
+      pos = newpos;
+      continue;
+    }
+    ++pos;
+    if(!labellen)
+      return iter == name.end();
+    if(iter == name.end() || iter->size() != labellen)
+      return false;
+    if(pos + labellen > payload.size())
+      throw std::out_of_range("label beyond end of packet");
+    if(!equalsIgnoreCase(&payload[pos], iter->d_s.c_str(), labellen))
+      return false;
+    pos += labellen;
+    ++iter;
+  }
+}
+
 // this is required to make the std::unique_ptr to DNSZone work. Long story.
 DNSMessageWriter::~DNSMessageWriter() = default;
 
@@ -175,15 +289,16 @@ static void nboInc(uint16_t& counter) // network byte order inc
   counter = htons(ntohs(counter) + 1);  
 }
 
-void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, uint32_t ttl, const std::unique_ptr<RRGen>& content, DNSClass dclass)
+template<typename F>
+void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, DNSType type, uint32_t ttl, DNSClass dclass, F content)
 {
   auto cursize = payloadpos;
   try {
     xfrName(name);
-    xfrUInt16((int)content->getType()); xfrUInt16((int)dclass);
+    xfrUInt16((int)type); xfrUInt16((int)dclass);
     xfrUInt32(ttl);
     auto pos = xfrUInt16(0); // placeholder
-    content->toMessage(*this);
+    content();
     xfrUInt16At(pos, payloadpos-pos-2);
   }
   catch(...) {
@@ -207,6 +322,16 @@ void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, uint32_t t
   }
 }
 
+void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, uint32_t ttl, const std::unique_ptr<RRGen>& content, DNSClass dclass)
+{
+  putRR(section, name, content->getType(), ttl, dclass, [&]() { content->toMessage(*this); });
+}
+
+void DNSMessageWriter::putRR(DNSSection section, const DNSName& name, uint32_t ttl, const RRRef& content, DNSClass dclass)
+{
+  putRR(section, name, content.list->getType(), ttl, dclass, [&]() { content.list->toMessage(content.n, *this); });
+}
+
 void DNSMessageWriter::putEDNS(uint16_t bufsize, RCode ercode, bool doBit)
 {
   auto cursize = payloadpos;
@@ -38,11 +38,36 @@ public:
   bool getRR(DNSSection& section, DNSName& name, DNSType& type, uint32_t& ttl, std::unique_ptr<RRGen>& content);
   void skipRRs(int n); //!< Skip over n RRs
 
+  /*! Where an RR is in the message. getRR(RRView&) fills this in without
+      decoding the name or the content, so skipping RRs you don't want is
+      cheap. Use getOwner(), ownerIs() and getContent() on the ones you do want. */
+  struct RRView
+  {
+    DNSSection section;
+    DNSType type;
+    DNSClass dclass;
+    uint32_t ttl;
+    uint16_t namepos;  //!< owner name, as position in payload
+    uint16_t rdatapos; //!< content, as position in payload
+    uint16_t rdlength; //!< length of the content
+  };
+  //! Describes the next RR in rr, unless at 'end of message', in which case it returns false
+  bool getRR(RRView& rr);
+  //! Decodes the owner name of rr
+  DNSName getOwner(const RRView& rr) { uint16_t pos = rr.namepos; return getName(&pos); }
+  //! Compares the owner name of rr to name, case insensitively, without decoding it
+  bool ownerIs(const RRView& rr, const DNSName& name) const;
+  //! Decodes the content of rr
+  std::unique_ptr<RRGen> getContent(const RRView& rr);
+  //! The undecoded content of rr, which is rr.rdlength bytes long
+  const uint8_t* rdata(const RRView& rr) const { return payload.data() + rr.rdatapos; }
+
   uint8_t d_ednsVersion{0};
 
   void xfrName(DNSName& ret, uint16_t* pos=0); //!< put the next name in ret, or copy it from pos
   //! Convenience form of xfrName that returns its result
   DNSName getName(uint16_t* pos=0) { DNSName res; xfrName(res, pos); return res;}
+  void skipName(uint16_t* pos=0); //!< skip over the next name, or the one at pos
   //! Gets the next 8 bit unsigned integer from the message, or the one from 'pos'
   void xfrUInt8(uint8_t&res, uint16_t* pos = 0)
   {
@@ -134,6 +159,8 @@ public:
   void randomizeID(); //!< Randomize the id field of our dnsheader
   void clearRRs();
   void putRR(DNSSection section, const DNSName& name, uint32_t ttl, const std::unique_ptr<RRGen>& rr, DNSClass dclass = DNSClass::IN);
+  //! Adds a record from an RRList, which does not need virtual calls
+  void putRR(DNSSection section, const DNSName& name, uint32_t ttl, const RRRef& rr, DNSClass dclass = DNSClass::IN);
   void setEDNS(uint16_t bufsize, bool doBit, RCode ercode = (RCode)0);
   std::string serialize();
 
@@ -192,6 +219,7 @@ public:
 private:
   std::unique_ptr<DNSNode> d_comptree;
   void putEDNS(uint16_t bufsize, RCode ercode, bool doBit);
+  template<typename F> void putRR(DNSSection section, const DNSName& name, DNSType type, uint32_t ttl, DNSClass dclass, F content);
   bool d_serialized{false};  // needed to make serialize() idempotent
 };
 
@@ -4,6 +4,7 @@
 #include <stdexcept>
 #include <algorithm>
 #include <array>
+#include <utility>
 #include <string.h>
 
 #define SMARTENUMSTART(x) static constexpr std::pair<x, const char*> enumtypemap##x[]= {
@@ -21,18 +22,105 @@
 #define SENUM12(x, a1, ...) SENUM(x,a1) SENUM11(x, __VA_ARGS__)
 #define SENUM13(x, a1, ...) SENUM(x,a1) SENUM12(x, __VA_ARGS__)
 
+/* toString() and make##x() used to scan the table above. Instead, we build two more tables
+   at compile time: one with the names indexed by value, and a hash table of the names, with
+   linear probing. The enums are small, so indexing by value wastes little space */
+namespace nenum {
+template<typename E>
+struct NameEntry
+{
+  const char* name;
+  E value;
+};
+
+template<typename E, size_t Size>
+struct ByName
+{
+  NameEntry<E> slots[Size];
+};
+
+template<size_t Size>
+struct ByValue
+{
+  const char* names[Size];
+};
+
+//! FNV-1a
+constexpr uint32_t hash(const char* str)
+{
+  uint32_t ret = 2166136261U;
+  for(; *str; ++str)
+    ret = (ret ^ (unsigned char)*str) * 16777619U;
+  return ret;
+}
+
+//! One more than the highest value in the table, the size of a table indexed by value
+template<typename E, size_t N>
+constexpr size_t valueTableSize(const std::pair<E, const char*> (&table)[N])
+{
+  size_t ret = 0;
+  for(size_t n = 0; n < N; ++n)
+    ret = std::max(ret, (size_t)table[n].first + 1);
+  return ret;
+}
+
+//! A power of two, so at most half of the hash table is in use
+constexpr size_t hashTableSize(size_t entries)
+{
+  size_t ret = 1;
+  while(ret < 2 * entries)
+    ret *= 2;
+  return ret;
+}
+
+template<size_t Size, typename E, size_t N>
+constexpr ByValue<Size> makeByValue(const std::pair<E, const char*> (&table)[N])
+{
+  ByValue<Size> ret{};
+  for(size_t n = 0; n < N; ++n)
+    ret.names[(size_t)table[n].first] = table[n].second;
+  return ret;
+}
+
+template<size_t Size, typename E, size_t N>
+constexpr ByName<E, Size> makeByName(const std::pair<E, const char*> (&table)[N])
+{
+  ByName<E, Size> ret{};
+  for(size_t n = 0; n < N; ++n) {
+    size_t pos = hash(table[n].second) & (Size - 1);
+    while(ret.slots[pos].name)
+      pos = (pos + 1) & (Size - 1);
+    ret.slots[pos].name = table[n].second;
+    ret.slots[pos].value = table[n].first;
+  }
+  return ret;
+}
+
+//! Finds name in a table made by makeByName, returns nullptr if it is not there
+template<typename E, size_t Size>
+const NameEntry<E>* lookup(const ByName<E, Size>& table, const char* name)
+{
+  for(size_t pos = hash(name) & (Size - 1); table.slots[pos].name; pos = (pos + 1) & (Size - 1))
+    if(!strcmp(table.slots[pos].name, name))
+      return &table.slots[pos];
+  return nullptr;
+}
+}
+
 #define SMARTENUMEND(x) };                                             \
+static_assert(nenum::valueTableSize(enumtypemap##x) <= 4096, "enum "#x" is too sparse for a table indexed by value"); \
+static constexpr auto enumbyvalue##x = nenum::makeByValue<nenum::valueTableSize(enumtypemap##x)>(enumtypemap##x); \
+static constexpr auto enumbyname##x = nenum::makeByName<nenum::hashTableSize(sizeof(enumtypemap##x) / sizeof(enumtypemap##x[0]))>(enumtypemap##x); \
 inline const char* toString(const x& t)                                \
 {                                                                      \
- for(const auto &a : enumtypemap##x)                                   \
-   if(a.first == t)                                                    \
-       return a.second;                                                \
+  auto v = (size_t)t;                                                  \
+  if(v < sizeof(enumbyvalue##x.names) / sizeof(const char*) && enumbyvalue##x.names[v]) \
+    return enumbyvalue##x.names[v];                                    \
   return "?";                                                          \
 }                                                                      \
 inline x make##x(const char* from) {                                   \
-for(const auto& a : enumtypemap##x)                                    \
-  if(!strcmp(a.second, from))                                          \
-    return a.first;                                                    \
+  if(auto entry = nenum::lookup(enumbyname##x, from))                  \
+    return entry->value;                                               \
   throw std::runtime_error("Unknown value '" + std::string(from) + "' for enum "#x); \
  }                                                                     \
 inline std::ostream& operator<<(std::ostream &os, const x& s) {        \
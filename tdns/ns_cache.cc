@@ -2,34 +2,140 @@
 
 using namespace std;
 
-map<DNSName, set<DNSName>> ns_cache;
-map<DNSName, set<ComboAddress>> addr_cache;
+zonecut_node ns_cache;
+map<DNSName, ns_addresses> addr_cache;
+mutex ns_cache_lock;
 
-void save_to_cache(DNSName zonecut, DNSName ns_name, ComboAddress address) {
+// Bumped on every change to the cache. Nodes and addresses remember when they last changed, so we
+// know which server lists are outdated
+static uint64_t cache_generation = 1;
+// Every this many saves, we remove expired delegations from the trie
+static const unsigned int PRUNE_INTERVAL = 1000;
+static unsigned int saves_since_prune = 0;
+
+// Removes expired zone cuts without children below node. Returns true if node itself can go
+static bool prune(zonecut_node& node, time_t now) {
+    for(auto iter = node.children.begin(); iter != node.children.end(); ) {
+        if (prune(*iter->second, now))
+            iter = node.children.erase(iter);
+        else
+            ++iter;
+    }
+    if (!node.is_zonecut(now)) {
+        node.ns_names.clear();
+        node.servers.reset();
+    }
+    return node.children.empty() && node.ns_names.empty();
+}
+
+void save_to_cache(DNSName zonecut, DNSName ns_name, ComboAddress address, uint32_t ttl) {
     cout << "saving " << zonecut << "\t" << ns_name << "\t" << address.toString() << endl;
-    ns_cache[zonecut].insert(ns_name);
+    lock_guard<mutex> l(ns_cache_lock);
+    time_t now = time(nullptr);
+    if (++saves_since_prune == PRUNE_INTERVAL) {
+        prune(ns_cache, now);
+        saves_since_prune = 0;
+    }
+
+    zonecut_node* node = &ns_cache;
+    for(auto iter = zonecut.d_name.crbegin(); iter != zonecut.d_name.crend(); ++iter) {
+        auto& child = node->children[*iter];
+        if (!child)
+            child = make_unique<zonecut_node>();
+        node = child.get();
+    }
+
+    if (!node->is_zonecut(now)) // expired, so these are the first NS records of a fresh set
+        node->ns_names.clear();
+    if (node->expire != numeric_limits<time_t>::max()) // the root hints never expire, whatever an NS record says
+        node->expire = ttl == NO_EXPIRY ? numeric_limits<time_t>::max() : now + ttl;
+    if (node->ns_names.insert(ns_name).second)
+        node->changed = ++cache_generation;
     if (address != NO_IP) {
-        addr_cache[ns_name].insert(address);
+        auto& known = addr_cache[ns_name];
+        if (known.addrs.insert(address).second)
+            known.changed = ++cache_generation;
     }
 }
 
-vector<pair<DNSName, ComboAddress>> get_from_cache(DNSName zonecut) {
+void save_address(DNSName ns_name, ComboAddress address) {
+    if (address.sin4.sin_family == 0) // not an A or AAAA
+        return;
+    lock_guard<mutex> l(ns_cache_lock);
+    auto& known = addr_cache[ns_name];
+    if (known.addrs.insert(address).second)
+        known.changed = ++cache_generation;
+}
+
+// Finds the node of zonecut, nullptr if it is not in the trie. Call with ns_cache_lock held
+static zonecut_node* find_node(const DNSName& zonecut) {
+    zonecut_node* node = &ns_cache;
+    for(auto iter = zonecut.d_name.crbegin(); iter != zonecut.d_name.crend(); ++iter) {
+        auto child = node->children.find(*iter);
+        if (child == node->children.end())
+            return nullptr;
+        node = child->second.get();
+    }
+    return node;
+}
+
+// Is the server list of node still what we would build now? Call with ns_cache_lock held
+static bool up_to_date(const zonecut_node& node) {
+    if (!node.servers || node.changed > node.built)
+        return false;
+    for(const auto& ns_name : node.ns_names) {
+        auto addrs = addr_cache.find(ns_name);
+        if (addrs != addr_cache.end() && addrs->second.changed > node.built)
+            return false;
+    }
+    return true;
+}
+
+shared_ptr<const ns_servers> get_from_cache(DNSName zonecut) {
     cout << "getting " << zonecut << endl;
-    vector<pair<DNSName, ComboAddress>> servers;
+    lock_guard<mutex> l(ns_cache_lock);
+    auto node = find_node(zonecut);
+    if (!node || !node->is_zonecut(time(nullptr)))
+        return make_shared<const ns_servers>();
+
+    if (up_to_date(*node))
+        return node->servers;
 
-    for(auto ns_name : ns_cache[zonecut]) {
-        if (addr_cache[ns_name].empty()) {
-            servers.push_back(make_pair(ns_name, NO_IP));
+    auto servers = make_shared<ns_servers>();
+    for(const auto& ns_name : node->ns_names) {
+        auto addrs = addr_cache.find(ns_name);
+        if (addrs == addr_cache.end() || addrs->second.addrs.empty()) {
+            servers->push_back(make_pair(ns_name, NO_IP));
         } else {
-            for(auto address : addr_cache[ns_name]) {
-                servers.push_back(make_pair(ns_name, address));
+            for(const auto& address : addrs->second.addrs) {
+                servers->push_back(make_pair(ns_name, address));
             }
         }
     }
-
+    node->servers = servers;
+    node->built = cache_generation;
     return servers;
 }
 
+DNSName get_closest_zonecut(DNSName name) {
+    lock_guard<mutex> l(ns_cache_lock);
+    time_t now = time(nullptr);
+    DNSName ret, walked;
+    const zonecut_node* node = &ns_cache;
+    for(auto iter = name.d_name.crbegin(); iter != name.d_name.crend(); ++iter) {
+        auto child = node->children.find(*iter);
+        if (child == node->children.end())
+            break;
+        node = child->second.get();
+        walked.push_front(*iter);
+        if (node->is_zonecut(now))
+            ret = walked;
+    }
+    return ret;
+}
+
 bool is_cached(DNSName ns_name) {
-    return !addr_cache[ns_name].empty();
-}
\ No newline at end of file
+    lock_guard<mutex> l(ns_cache_lock);
+    auto iter = addr_cache.find(ns_name);
+    return iter != addr_cache.end() && !iter->second.addrs.empty();
+}
@@ -1,7 +1,12 @@
 #pragma once
 
 #include <map>
+#include <set>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <ctime>
+#include <limits>
 #include "sclasses.hh"
 #include "record-types.hh"
 
@@ -9,10 +14,44 @@
 using namespace std;
 
 const auto NO_IP = ComboAddress();
+const uint32_t NO_EXPIRY = numeric_limits<uint32_t>::max();
 
-extern map<DNSName, set<DNSName>> ns_cache;
-extern map<DNSName, set<ComboAddress>> addr_cache;
+// The nameservers of a zone cut, with all their addresses. A name without known addresses is listed with NO_IP
+typedef vector<pair<DNSName, ComboAddress>> ns_servers;
 
-void save_to_cache(DNSName zonecut, DNSName ns_name, ComboAddress address = NO_IP);
+// Delegations live in a trie of labels, starting at the root. Each node is one label further
+// away from the root, so the deepest zone cut of a name is found in a single walk down the trie.
+// All of this is shared by all threads, only touch it with ns_cache_lock held
+struct zonecut_node {
+    map<DNSLabel, unique_ptr<zonecut_node>> children;
+    set<DNSName> ns_names;     // empty if this node is not a zone cut (anymore)
+    uint64_t changed = 0;      // the cache generation at which ns_names last changed
+    time_t expire = 0;
+    // the server list we last handed out, and the cache generation it was built at
+    shared_ptr<const ns_servers> servers;
+    uint64_t built = 0;
+
+    bool is_zonecut(time_t now) const {
+        return !ns_names.empty() && expire > now;
+    }
+};
+
+// The addresses of a nameserver, and the cache generation at which they last changed
+struct ns_addresses {
+    set<ComboAddress> addrs;
+    uint64_t changed = 0;
+};
+
+extern zonecut_node ns_cache;
+extern map<DNSName, ns_addresses> addr_cache;
+extern mutex ns_cache_lock;
+
+// Adds ns_name to the nameservers of zonecut, which are valid for ttl seconds from now
+void save_to_cache(DNSName zonecut, DNSName ns_name, ComboAddress address = NO_IP, uint32_t ttl = NO_EXPIRY);
+void save_address(DNSName ns_name, ComboAddress address);
 bool is_cached(DNSName ns_name);
-vector<pair<DNSName, ComboAddress>> get_from_cache(DNSName zonecut);
+// The servers of zonecut, empty if it is not a zone cut we know about. Don't hold on to this for long,
+// as it does not change when the cache does
+shared_ptr<const ns_servers> get_from_cache(DNSName zonecut);
+// The deepest zone cut we know nameservers for that name is part of, the root if there is none
+DNSName get_closest_zonecut(DNSName name);
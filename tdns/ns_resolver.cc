@@ -0,0 +1,111 @@
+#include <set>
+
+#include "ns_resolver.hh"
+#include "ns_cache.hh"
+#include "tres.hh"
+
+NSAddressResolver ns_resolver;
+
+// set in worker threads, which must not wait for other workers
+static thread_local bool is_worker = false;
+// nameservers this thread is looking up, to break cycles of glueless delegations
+static thread_local set<DNSName> resolving;
+
+void NSAddressResolver::start_workers() {
+    // called with the lock held. Workers live as long as tres does
+    for (; num_started < num_workers; ++num_started) {
+        thread t(&NSAddressResolver::worker, this);
+        t.detach();
+    }
+}
+
+void NSAddressResolver::submit(const DNSName& ns_name) {
+    if (is_cached(ns_name))
+        return;
+    lock_guard<mutex> l(lock);
+    if (in_flight.count(ns_name))
+        return; // deduplicated
+    start_workers();
+    in_flight[ns_name] = 2;
+    queue.push_back({ns_name, DNSType::A});
+    queue.push_back({ns_name, DNSType::AAAA});
+    work_available.notify_all();
+}
+
+bool NSAddressResolver::wait_for_address(const DNSName& ns_name, double timeout, TDNSResolver& resolver, int depth) {
+    if (is_worker) {
+        // All workers might be waiting on each other, so do it ourselves, serially
+        if (resolving.count(ns_name)) {
+            cerr << "Nameserver " << ns_name << " depends on itself" << endl;
+            return false;
+        }
+        resolving.insert(ns_name);
+        bool found = false;
+        try {
+            for (auto type : {DNSType::A, DNSType::AAAA}) {
+                lookup({ns_name, type}, resolver, depth + 1);
+                if ((found = is_cached(ns_name)))
+                    break;
+            }
+        }
+        catch(...) {
+            resolving.erase(ns_name);
+            throw;
+        }
+        resolving.erase(ns_name);
+        return found;
+    }
+
+    submit(ns_name);
+    auto deadline = chrono::steady_clock::now() + chrono::microseconds((int64_t)(timeout * 1000000));
+    unique_lock<mutex> l(lock);
+    // is_cached takes the ns_cache lock while we hold ours, never the other way around
+    lookup_done.wait_until(l, deadline, [this, &ns_name]() { return is_cached(ns_name) || !in_flight.count(ns_name); } );
+    return is_cached(ns_name);
+}
+
+// running out of queries is left to whoever owns 'resolver'
+void NSAddressResolver::lookup(const job& j, TDNSResolver& resolver, int depth)
+try
+{
+    auto ret = resolver.resolveAt(j.name, j.type, depth);
+    for (const auto& res : ret.res)
+        save_address(j.name, getIP(res.rr));
+}
+catch(TooManyQueriesException& e)
+{
+    throw;
+}
+catch(...)
+{
+    cerr << "Nameserver lookup of " << j.name << "|" << j.type << " failed" << endl;
+}
+
+void NSAddressResolver::worker() {
+    is_worker = true;
+    for (;;) {
+        job j;
+        {
+            unique_lock<mutex> l(lock);
+            work_available.wait(l, [this]() { return !queue.empty(); });
+            j = queue.front();
+            queue.pop_front();
+        }
+        // a queued job is a resolution of its own, with a fresh query budget
+        TDNSResolver resolver(g_root);
+        resolving.insert(j.name);
+        try {
+            lookup(j, resolver, 0);
+        }
+        catch(TooManyQueriesException& e) {
+            cerr << "Nameserver lookup of " << j.name << "|" << j.type << " died after too many queries" << endl;
+        }
+        resolving.erase(j.name);
+        {
+            lock_guard<mutex> l(lock);
+            if (!--in_flight[j.name])
+                in_flight.erase(j.name);
+        }
+        lookup_done.notify_all();
+    }
+}
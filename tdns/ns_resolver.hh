@@ -0,0 +1,56 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <map>
+
+#include "record-types.hh"
+
+using namespace std;
+
+class TDNSResolver;
+
+/*!
+   @file
+   @brief Resolves addresses of nameservers in the background
+
+   Delegations often come without glue, so we need to look up the addresses
+   of nameservers ourselves. This is done by a fixed number of worker threads,
+   which look up A and AAAA at the same time. If several resolutions need the
+   same nameserver, it is only looked up once. Addresses end up in addr_cache,
+   where Selection::get_transport() finds them.
+*/
+class NSAddressResolver {
+public:
+    NSAddressResolver(unsigned int workers = 8) : num_workers(workers) {};
+
+    //! Start looking up the addresses of ns_name, unless we are already doing that. Does not block
+    void submit(const DNSName& ns_name);
+
+    /** Like submit, but waits until at least one address of ns_name is known, both lookups are done,
+        or timeout seconds have passed. Returns true if we have an address.
+        On a worker thread, the lookups are instead done right away by 'resolver' at depth+1, so they
+        count against its query budget. A name this thread is already resolving is not looked up again */
+    bool wait_for_address(const DNSName& ns_name, double timeout, TDNSResolver& resolver, int depth);
+
+private:
+    struct job {
+        DNSName name;
+        DNSType type;
+    };
+    void start_workers();
+    void worker();
+    void lookup(const job& j, TDNSResolver& resolver, int depth);
+
+    unsigned int num_workers;
+    mutex lock;
+    condition_variable work_available;
+    condition_variable lookup_done;
+    deque<job> queue;
+    map<DNSName, int> in_flight; // number of lookups still running per name
+    unsigned int num_started = 0;
+};
+
+extern NSAddressResolver ns_resolver;
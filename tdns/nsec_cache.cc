@@ -0,0 +1,118 @@
+#include "nsec_cache.hh"
+
+using namespace std;
+
+NSECCache g_nseccache;
+
+//! The longest name that both a and b are part of
+static DNSName commonAncestor(const DNSName& a, const DNSName& b)
+{
+  DNSName ret;
+  auto us = a.d_name.crbegin(), them = b.d_name.crbegin();
+  for(; us != a.d_name.crend() && them != b.d_name.crend() && *us == *them; ++us, ++them)
+    ret.push_front(*us);
+  return ret;
+}
+
+void NSECCache::store(const DNSName& zone, const DNSName& owner, const NSECGen& nsec, uint32_t ttl)
+{
+  if(!owner.isPartOf(zone) || !nsec.d_next.isPartOf(zone))
+    return;
+  std::lock_guard<std::mutex> l(d_lock);
+  time_t now = time(nullptr);
+  if(d_size >= d_maxentries)
+    purge(now);
+  if(d_size >= d_maxentries)
+    return;
+
+  auto res = d_zones[zone].insert({owner, Entry()});
+  if(res.second)
+    d_size++;
+  res.first->second = {nsec.d_next, nsec.d_types, now + ttl};
+}
+
+/* Finds the NSEC record that either matches dn (match is set to true) or proves it does not exist.
+   Returns zone.end() if there is no such record. Called with the lock held */
+NSECCache::zone_t::const_iterator NSECCache::find(const zone_t& zone, const DNSName& dn, time_t now, bool& match) const
+{
+  auto iter = zone.upper_bound(dn); // the first owner that sorts after dn
+  if(iter == zone.begin())
+    return zone.end();
+  --iter;
+  const auto& owner = iter->first;
+  const auto& e = iter->second;
+  if(e.expire <= now)
+    return zone.end();
+
+  match = (owner == dn);
+  if(match)
+    return iter;
+
+  bool last = !owner.canonCompare(e.next); // the last NSEC of the zone points back at the apex
+  if(!last && !dn.canonCompare(e.next))
+    return zone.end();
+  if(dn.isPartOf(owner) && e.types.count(DNSType::NS) && !e.types.count(DNSType::SOA))
+    return zone.end(); // owner is a delegation, and dn lives in the child zone
+  return iter;
+}
+
+NSECCache::Result NSECCache::lookup(const DNSName& dn, DNSType dt)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  time_t now = time(nullptr);
+
+  DNSName zonename(dn); // the closest enclosing zone we have NSEC records for
+  decltype(d_zones)::const_iterator ziter;
+  while((ziter = d_zones.find(zonename)) == d_zones.end()) {
+    if(zonename.empty())
+      return Result::Unknown;
+    zonename.pop_front();
+  }
+  const auto& zone = ziter->second;
+
+  bool match = false;
+  auto iter = find(zone, dn, now, match);
+  if(iter == zone.end())
+    return Result::Unknown;
+  const auto& types = iter->second.types;
+  if(match) {
+    if(types.count(dt) || types.count(DNSType::CNAME))
+      return Result::Unknown;
+    if(types.count(DNSType::NS) && !types.count(DNSType::SOA))
+      return Result::Unknown;   // parent side of a delegation, the child knows the types
+    d_nodatas++;
+    return Result::Nodata;
+  }
+
+  // dn does not exist, but a wildcard could still produce an answer for it
+  DNSName ce = commonAncestor(dn, iter->first), ce2 = commonAncestor(dn, iter->second.next);
+  if(ce2.size() > ce.size())
+    ce = ce2;
+  DNSName wildcard(ce);
+  wildcard.push_front("*");
+  bool wmatch = false;
+  if(find(zone, wildcard, now, wmatch) == zone.end() || wmatch)
+    return Result::Unknown;
+  d_nxdomains++;
+  return Result::Nxdomain;
+}
+
+//! Removes expired records, called with the lock held
+void NSECCache::purge(time_t now)
+{
+  for(auto ziter = d_zones.begin(); ziter != d_zones.end(); ) {
+    auto& zone = ziter->second;
+    for(auto iter = zone.begin(); iter != zone.end(); ) {
+      if(iter->second.expire <= now) {
+        iter = zone.erase(iter);
+        d_size--;
+      }
+      else
+        ++iter;
+    }
+    if(zone.empty())
+      ziter = d_zones.erase(ziter);
+    else
+      ++ziter;
+  }
+}
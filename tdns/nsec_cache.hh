@@ -0,0 +1,71 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <ctime>
+#include "record-types.hh"
+
+/*!
+   @file
+   @brief Aggressive use of cached NSEC records (RFC 8198) in tres
+
+   An NSEC record says that no names exist between its owner and its 'next'
+   name, and lists the types that do exist at the owner. Once we have seen
+   such a record, every query for a name in that range can be answered with
+   NXDOMAIN, and every query for a missing type at the owner with NODATA,
+   without asking the authoritative servers again. Random subdomain attacks
+   on a signed zone then cost a single upstream query per NSEC range.
+
+   For each zone, the cached NSEC records are kept in a map in DNSSEC
+   canonical order, so finding the record that covers a name is a single
+   lookup.
+
+   Note that tres does not validate DNSSEC signatures, which RFC 8198 does
+   require. Records are only accepted from authoritative answers, and only
+   for the zone the answer came from, but that is where the protection ends.
+   This is why it is off by default.
+*/
+
+class NSECCache
+{
+public:
+  enum class Result { Unknown, Nxdomain, Nodata };
+
+  /** Stores an NSEC record of zone, with the TTL it may be used for. Records that are
+      not part of zone are ignored */
+  void store(const DNSName& zone, const DNSName& owner, const NSECGen& nsec, uint32_t ttl);
+  //! Can the cached NSEC records prove that dn, or type dt at dn, does not exist?
+  Result lookup(const DNSName& dn, DNSType dt);
+
+  bool d_enabled{false};
+  size_t d_maxentries{100000};
+
+  //! statistics
+  uint64_t d_nxdomains{0}, d_nodatas{0};
+
+private:
+  struct Entry
+  {
+    DNSName next;
+    std::set<DNSType> types;
+    time_t expire;
+  };
+  struct CanonLess
+  {
+    bool operator()(const DNSName& a, const DNSName& b) const
+    {
+      return a.canonCompare(b);
+    }
+  };
+  typedef std::map<DNSName, Entry, CanonLess> zone_t;
+
+  zone_t::const_iterator find(const zone_t& zone, const DNSName& dn, time_t now, bool& match) const;
+  void purge(time_t now);
+
+  std::mutex d_lock;
+  std::map<DNSName, zone_t> d_zones;
+  size_t d_size{0};
+};
+
+extern NSECCache g_nseccache;
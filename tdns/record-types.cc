@@ -406,3 +406,238 @@ void RRSIGGen::xfrSignature(DNSStringReader& dmw)
 }
 
 BOILERPLATE(RRSIG)
+
+///////////////////////////////
+
+// RFC 4034 4.1.2, window number, bitmap length, bitmap. NSEC3 uses the same format
+static void readTypeBitmap(DNSMessageReader& dmr, std::set<DNSType>& types)
+{
+  while(!dmr.eor()) {
+    uint8_t window = dmr.getUInt8();
+    uint8_t len = dmr.getUInt8();
+    for(unsigned int n = 0; n < len; ++n) {
+      uint8_t bits = dmr.getUInt8();
+      for(unsigned int bit = 0; bit < 8; ++bit)
+        if(bits & (0x80 >> bit))
+          types.insert((DNSType)(window * 256 + n * 8 + bit));
+    }
+  }
+}
+
+static void writeTypeBitmap(DNSMessageWriter& dmw, const std::set<DNSType>& types)
+{
+  std::string bitmap;
+  int window = -1;
+  auto flush = [&]() {
+    if(window >= 0) {
+      dmw.xfrUInt8(window);
+      dmw.xfrUInt8(bitmap.size());
+      dmw.xfrBlob(bitmap);
+    }
+    bitmap.clear();
+  };
+  for(const auto& t : types) { // std::set, so these are in order
+    if((int)t / 256 != window) {
+      flush();
+      window = (int)t / 256;
+    }
+    unsigned int pos = ((int)t % 256) / 8;
+    if(bitmap.size() <= pos)
+      bitmap.resize(pos + 1, '\0');
+    bitmap[pos] |= 0x80 >> ((int)t % 8);
+  }
+  flush();
+}
+
+static std::string typesToString(const std::set<DNSType>& types)
+{
+  std::string ret;
+  for(const auto& t : types) {
+    ret.append(1, ' ');
+    if(!strcmp(::toString(t), "?"))
+      ret += "TYPE" + std::to_string((int)t);
+    else
+      ret += ::toString(t);
+  }
+  return ret;
+}
+
+NSECGen::NSECGen(DNSMessageReader& dmr)
+{
+  d_next = dmr.getName();
+  readTypeBitmap(dmr, d_types);
+}
+
+void NSECGen::toMessage(DNSMessageWriter& dmw)
+{
+  dmw.xfrName(d_next, false); // no compression in the Next Domain Name field
+  writeTypeBitmap(dmw, d_types);
+}
+
+std::string NSECGen::toString() const
+{
+  return d_next.toString() + typesToString(d_types);
+}
+
+///////////////////////////////
+
+NSEC3Gen::NSEC3Gen(DNSMessageReader& dmr)
+{
+  d_algorithm = dmr.getUInt8();
+  d_flags = dmr.getUInt8();
+  d_iterations = dmr.getUInt16();
+  d_salt = dmr.getBlob(dmr.getUInt8());
+  d_next = dmr.getBlob(dmr.getUInt8());
+  readTypeBitmap(dmr, d_types);
+}
+
+void NSEC3Gen::toMessage(DNSMessageWriter& dmw)
+{
+  dmw.xfrUInt8(d_algorithm);
+  dmw.xfrUInt8(d_flags);
+  dmw.xfrUInt16(d_iterations);
+  dmw.xfrUInt8(d_salt.size());
+  dmw.xfrBlob(d_salt);
+  dmw.xfrUInt8(d_next.size());
+  dmw.xfrBlob(d_next);
+  writeTypeBitmap(dmw, d_types);
+}
+
+std::string NSEC3Gen::toString() const
+{
+  std::ostringstream ret;
+  ret << (int)d_algorithm << " " << (int)d_flags << " " << d_iterations << " ";
+  if(d_salt.empty())
+    ret << "-";
+  for(const auto& c : d_salt)
+    ret << std::setw(2) << std::setfill('0') << std::hex << (unsigned int)(unsigned char)c;
+  ret << " " << toBase32Hex(d_next) << typesToString(d_types);
+  return ret.str();
+}
+
+std::string toBase32Hex(const std::string& in)
+{
+  static const char alphabet[] = "0123456789abcdefghijklmnopqrstuv";
+  std::string ret;
+  unsigned int bits = 0, nbits = 0;
+  for(const auto& c : in) {
+    bits = (bits << 8) | (unsigned char)c;
+    nbits += 8;
+    while(nbits >= 5) {
+      nbits -= 5;
+      ret.append(1, alphabet[(bits >> nbits) & 0x1f]);
+    }
+    bits &= (1 << nbits) - 1;
+  }
+  if(nbits)
+    ret.append(1, alphabet[(bits << (5 - nbits)) & 0x1f]);
+  return ret;
+}
+
+bool fromBase32Hex(const std::string& in, std::string& out)
+{
+  out.clear();
+  unsigned int bits = 0, nbits = 0;
+  for(const auto& c : in) {
+    unsigned int val;
+    if(c >= '0' && c <= '9')
+      val = c - '0';
+    else if(c >= 'a' && c <= 'v')
+      val = c - 'a' + 10;
+    else if(c >= 'A' && c <= 'V')
+      val = c - 'A' + 10;
+    else
+      return false;
+    bits = (bits << 5) | val;
+    nbits += 5;
+    if(nbits >= 8) {
+      nbits -= 8;
+      out.append(1, (char)(bits >> nbits));
+      bits &= (1 << nbits) - 1;
+    }
+  }
+  return !bits; // the bits left over must be 0
+}
+
+///////////////////////////////
+
+namespace {
+template<typename T>
+struct TypedRRStorage : RRStorage
+{
+  void release(std::vector<std::unique_ptr<RRGen>>& to) override
+  {
+    for(auto& r : records)
+      to.push_back(std::make_unique<T>(std::move(r)));
+    records.clear();
+  }
+  std::vector<T> records;
+};
+}
+
+//! Stores rr by value if it is a T, and the list is empty or has Ts by value
+template<typename T>
+bool RRList::addByValue(std::unique_ptr<RRGen>& rr)
+{
+  if(typeid(*rr) != typeid(T) || (d_size && (!d_storage || *d_class != typeid(T))))
+    return false;
+  if(!d_storage) {
+    d_storage = std::make_unique<TypedRRStorage<T>>();
+    d_class = &typeid(T);
+    d_stride = sizeof(T);
+  }
+  auto& records = static_cast<TypedRRStorage<T>*>(d_storage.get())->records;
+  records.push_back(std::move(static_cast<T&>(*rr)));
+  rr.reset();
+  // this may have moved the records
+  d_data = reinterpret_cast<const char*>(records.data());
+  d_base = reinterpret_cast<const char*>(static_cast<const RRGen*>(records.data()));
+  return true;
+}
+
+void RRList::add(std::unique_ptr<RRGen>&& rr)
+{
+  if(!d_size)
+    d_type = rr->getType();
+  if(!(addByValue<AGen>(rr) || addByValue<AAAAGen>(rr) || addByValue<NSGen>(rr) ||
+       addByValue<CNAMEGen>(rr) || addByValue<PTRGen>(rr) || addByValue<MXGen>(rr) ||
+       addByValue<SOAGen>(rr) || addByValue<SRVGen>(rr) || addByValue<NAPTRGen>(rr) ||
+       addByValue<TXTGen>(rr) || addByValue<NSECGen>(rr) || addByValue<NSEC3Gen>(rr) ||
+       addByValue<RRSIGGen>(rr))) {
+    if(d_storage) { // a record of another class, so we can no longer store them by value
+      d_storage->release(d_pointers);
+      d_storage.reset();
+      d_class = nullptr;
+    }
+    d_pointers.push_back(std::move(rr));
+  }
+  d_size++;
+}
+
+/* The qualified calls below are not virtual, so the compiler can inline them. Each class we
+   store by value has its own DNSType, so d_type tells us what we have */
+void RRList::toMessage(size_t n, DNSMessageWriter& dmw) const
+{
+  if(!d_storage) {
+    d_pointers[n]->toMessage(dmw);
+    return;
+  }
+  auto rr = const_cast<char*>(d_data + n * d_stride);
+  switch(d_type) {
+  case DNSType::A:      reinterpret_cast<AGen*>(rr)->AGen::toMessage(dmw); break;
+  case DNSType::AAAA:   reinterpret_cast<AAAAGen*>(rr)->AAAAGen::toMessage(dmw); break;
+  case DNSType::NS:     reinterpret_cast<NSGen*>(rr)->NSGen::toMessage(dmw); break;
+  case DNSType::CNAME:  reinterpret_cast<CNAMEGen*>(rr)->CNAMEGen::toMessage(dmw); break;
+  case DNSType::PTR:    reinterpret_cast<PTRGen*>(rr)->PTRGen::toMessage(dmw); break;
+  case DNSType::MX:     reinterpret_cast<MXGen*>(rr)->MXGen::toMessage(dmw); break;
+  case DNSType::SOA:    reinterpret_cast<SOAGen*>(rr)->SOAGen::toMessage(dmw); break;
+  case DNSType::SRV:    reinterpret_cast<SRVGen*>(rr)->SRVGen::toMessage(dmw); break;
+  case DNSType::NAPTR:  reinterpret_cast<NAPTRGen*>(rr)->NAPTRGen::toMessage(dmw); break;
+  case DNSType::TXT:    reinterpret_cast<TXTGen*>(rr)->TXTGen::toMessage(dmw); break;
+  case DNSType::NSEC:   reinterpret_cast<NSECGen*>(rr)->NSECGen::toMessage(dmw); break;
+  case DNSType::NSEC3:  reinterpret_cast<NSEC3Gen*>(rr)->NSEC3Gen::toMessage(dmw); break;
+  case DNSType::RRSIG:  reinterpret_cast<RRSIGGen*>(rr)->RRSIGGen::toMessage(dmw); break;
+  default:
+    const_cast<RRGen&>(at(n)).toMessage(dmw);
+  }
+}
@@ -257,6 +257,43 @@ struct RRSIGGen : RRGen
   void xfrSignature(DNSStringReader& dmw);
 };
 
+//! Generates an NSEC Resource Record, which says there are no names between its owner and d_next
+struct NSECGen : RRGen
+{
+  NSECGen(const DNSName& next, const std::set<DNSType>& types) : d_next(next), d_types(types) {}
+  NSECGen(DNSMessageReader& dmr);
+  static std::unique_ptr<RRGen> make(const DNSName& next, const std::set<DNSType>& types)
+  {
+    return std::make_unique<NSECGen>(next, types);
+  }
+  void toMessage(DNSMessageWriter& dpw) override;
+  std::string toString() const override;
+  DNSType getType() const override { return DNSType::NSEC; }
+  DNSName d_next;
+  std::set<DNSType> d_types; //!< the types that exist at the owner name
+};
+
+//! Generates an NSEC3 Resource Record (RFC 5155). Like NSEC, but for hashed owner names
+struct NSEC3Gen : RRGen
+{
+  NSEC3Gen(uint16_t iterations, const std::string& salt, const std::string& next, const std::set<DNSType>& types, uint8_t flags = 0) :
+    d_flags(flags), d_iterations(iterations), d_salt(salt), d_next(next), d_types(types)
+  {}
+  NSEC3Gen(DNSMessageReader& dmr);
+  static std::unique_ptr<RRGen> make(uint16_t iterations, const std::string& salt, const std::string& next, const std::set<DNSType>& types)
+  {
+    return std::make_unique<NSEC3Gen>(iterations, salt, next, types);
+  }
+  void toMessage(DNSMessageWriter& dpw) override;
+  std::string toString() const override;
+  DNSType getType() const override { return DNSType::NSEC3; }
+  uint8_t d_algorithm{1}; //!< 1 is SHA-1, the only one there is
+  uint8_t d_flags;        //!< 1 is opt-out
+  uint16_t d_iterations;
+  std::string d_salt;
+  std::string d_next;        //!< the next hashed owner name, binary
+  std::set<DNSType> d_types; //!< the types that exist at the original owner name
+};
 
 //! Generates an TXT Resource Record
 struct TXTGen : RRGen
@@ -297,3 +334,8 @@ struct ClockTXTGen : RRGen
   DNSType getType() const override { return DNSType::TXT; }
   std::string d_format;
 };
+
+//! Encodes binary data as base32hex (RFC 4648), in lowercase and without padding, as NSEC3 does
+std::string toBase32Hex(const std::string& in);
+//! The reverse of toBase32Hex, which also accepts uppercase. Returns false for invalid input
+bool fromBase32Hex(const std::string& in, std::string& out);
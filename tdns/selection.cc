@@ -9,95 +9,246 @@ struct SelectionException : public std::exception {
     }
 };
 
-transport Selection::get_transport() {
-    double epsilon = 0.5;
+map<DNSName, ZoneRanking> zone_rankings;
+mutex selection_lock;
+
+// After this many picks we sort a ranking again, so servers that got faster move up
+static const unsigned int RERANK_INTERVAL = 64;
+
+// Every this many lookups, we remove servers we have not heard from in a long time,
+// and the rankings of zone cuts that are gone
+static const unsigned int INFRA_PURGE_INTERVAL = 10000;
+
+// The state of address, which starts over if we haven't heard from it in INFRA_HOST_TTL,
+// like the infra cache of unbound. Call with selection_lock held
+static GlobalServerState& server_state(const ComboAddress& address, time_t now) {
+    static unsigned int lookups = 0;
+    if (++lookups == INFRA_PURGE_INTERVAL) {
+        lookups = 0;
+        for (auto iter = selection_cache.begin(); iter != selection_cache.end(); ) {
+            if (iter->second.expired(now))
+                iter = selection_cache.erase(iter);
+            else
+                ++iter;
+        }
+    }
+    auto& state = selection_cache[address];
+    if (state.expired(now))
+        state = GlobalServerState();
+    return state;
+}
 
-    auto servers = get_from_cache(zonecut);
+// Every thread has its own random numbers, seeding one is expensive
+static mt19937& rng() {
+    static thread_local mt19937 gen{random_device{}()};
+    return gen;
+}
 
-    vector<server> with_ip;
-    vector<server> without_ip;
+static void sort_ranking(ZoneRanking& ranking) {
+    time_t now = time(nullptr);
+    for (auto& rs : ranking.with_ip)
+        rs.timeout = server_state(rs.s.second, now).get_timeout(now);
+    stable_sort(ranking.with_ip.begin(), ranking.with_ip.end(), [](const RankedServer &a, const RankedServer &b) {
+        return a.timeout < b.timeout;});
+    ranking.picks = 0;
+}
 
-    // We tried to resolve this name but we failed so there is no point in trying again, I guess
-    // https://en.wikipedia.org/wiki/Erase%E2%80%93remove_idiom
-    servers.erase(remove_if(servers.begin(), servers.end(), [this](server s){return this->local_state[s].cantResolveName();}), servers.end());
-
-    for(auto server : servers) {
-        if(server.second == NO_IP) {
-            without_ip.push_back(server);
-        } else {
-            with_ip.push_back(server);
-        }
+// Removes rankings we no longer need. The ns_cache prunes expired zone cuts under its own lock,
+// which we can't take from there, and after that we hold the last reference to their server lists.
+// Call with selection_lock held, and no references to rankings
+static void purge_rankings(time_t now) {
+    for (auto iter = zone_rankings.begin(); iter != zone_rankings.end(); ) {
+        if (iter->second.expired(now))
+            iter = zone_rankings.erase(iter);
+        else
+            ++iter;
     }
+}
 
-    if (!servers.size()) {
-        // No servers left. :(
-        throw SelectionException();
+// The ranking of our zone cut, rebuilt if the nameservers changed. Call with selection_lock held
+ZoneRanking& Selection::get_ranking() {
+    static unsigned int lookups = 0;
+    time_t now = time(nullptr);
+    if (++lookups == INFRA_PURGE_INTERVAL) {
+        lookups = 0;
+        purge_rankings(now);
     }
+    auto servers = get_from_cache(zonecut); // the same pointer until the cache changes
+    auto& ranking = zone_rankings[zonecut];
+    ranking.last_used = now;
+    if (ranking.servers != servers) {
+        ranking.servers = servers;
+        ranking.with_ip.clear();
+        ranking.without_ip.clear();
+        for (const auto& server : *servers) {
+            if (server.second == NO_IP)
+                ranking.without_ip.push_back(server);
+            else
+                ranking.with_ip.push_back({server, 0});
+        }
+        // Shuffle to randomize order in the beginning (where all timeouts are the same)
+        shuffle(ranking.with_ip.begin(), ranking.with_ip.end(), rng());
+        sort_ranking(ranking);
+    }
+    else if (++ranking.picks >= RERANK_INTERVAL) {
+        sort_ranking(ranking);
+    }
+    return ranking;
+}
 
-    random_device rd;
-    mt19937 g(rd());
-
-    std::uniform_real_distribution<> dis = std::uniform_real_distribution<>(0.0, 1.0);
+// address got new feedback, move it to its new place in our ranking. Call with selection_lock held
+void Selection::rerank(const ComboAddress& address) {
+    auto iter = zone_rankings.find(zonecut);
+    if (iter == zone_rankings.end())
+        return;
+    auto& with_ip = iter->second.with_ip;
+    auto pos = find_if(with_ip.begin(), with_ip.end(), [&address](const RankedServer& rs) { return rs.s.second == address; });
+    if (pos == with_ip.end())
+        return;
+    time_t now = time(nullptr);
+    pos->timeout = server_state(address, now).get_timeout(now);
+    // the rest is still sorted, so this is a single step of insertion sort
+    while (pos != with_ip.begin() && pos->timeout < (pos - 1)->timeout) {
+        iter_swap(pos, pos - 1);
+        --pos;
+    }
+    while (pos + 1 != with_ip.end() && (pos + 1)->timeout < pos->timeout) {
+        iter_swap(pos, pos + 1);
+        ++pos;
+    }
+}
 
-    if(dis(g) > epsilon && with_ip.size()) {
-        cout << "EXPLOIT!" << endl;
+// The best server with an address other than skip. Among the servers with the fewest errors in
+// this resolution, all servers within RTT_BAND of the fastest are equally good, and we pick one
+// of those at random. So we spread our queries, and learn about the RTT of more servers.
+// Call with selection_lock held
+const RankedServer* Selection::best_with_ip(ZoneRanking& ranking, const ComboAddress& skip) {
+    const RankedServer* best = nullptr;
+    unsigned int best_errors = 0;
+    for (const auto& rs : ranking.with_ip) {
+        if (rs.s.second == skip)
+            continue;
+        auto errors = local_state[rs.s].errors;
+        if (!best || errors < best_errors) {
+            best = &rs;
+            best_errors = errors;
+            if (!errors)
+                break;
+        }
+    }
+    if (!best)
+        return best;
+
+    vector<const RankedServer*> band;
+    for (const auto& rs : ranking.with_ip) {
+        if (rs.timeout > best->timeout + RTT_BAND) // sorted on timeout, so we are done
+            break;
+        if (rs.s.second != skip && local_state[rs.s].errors == best_errors)
+            band.push_back(&rs);
+    }
+    if (band.size() < 2)
+        return best;
+    std::uniform_int_distribution<size_t> pick(0, band.size() - 1);
+    return band[pick(rng())];
+}
 
-        // Shuffle to randomize order in the beginning (where all timeouts are MIN_TIMEOUT)
-        // This can be replaced by adding random small values to timeout when inicializing GlobalState
-        shuffle(with_ip.begin(), with_ip.end(), g);
+transport Selection::make_transport(const server& s, bool tcp) {
+    time_t now = time(nullptr);
+    return {.name = s.first,
+            .address = s.second,
+            .TCP = tcp,
+            .timeout = server_state(s.second, now).get_timeout(now),
+           };
+}
 
-        // Sort by local server state (now only errors) primarily (broken servers in the back) and by rtt secondarily
-        stable_sort(with_ip.begin(), with_ip.end(), [](const server &a, const server &b) {
-            return selection_cache[a.second].get_timeout() < selection_cache[b.second].get_timeout();});
+transport Selection::get_transport() {
+    double epsilon = 0.5;
+    std::uniform_real_distribution<> dis(0.0, 1.0);
 
-        stable_sort(with_ip.begin(), with_ip.end(), [this](const server &a, const server &b) {
-            return this->local_state[a].errors < this->local_state[b].errors;});
+    unique_lock<mutex> l(selection_lock);
+    auto& ranking = get_ranking();
 
-        for (auto server : with_ip)
-            cout << local_state[server].errors << " " << selection_cache[server.second].timeout/1000 << " ms\t\t" << server.first << "\t" << server.second.toString() << " " << endl;
+    // We tried to resolve this name but we failed so there is no point in trying again, I guess
+    auto resolvable = [this](const server& s) { return !this->local_state[s].cantResolveName(); };
 
-        // Best RTT over servers with minimal number of errors
-        server choice = with_ip.at(0);
+    if(dis(rng()) > epsilon && ranking.with_ip.size()) {
+        // Exploit: best RTT over servers with minimal number of errors
+        server choice = best_with_ip(ranking, NO_IP)->s;
 
+        transport ret = make_transport(choice, doTCP);
 
         // Also resolve one asynchronously for good measure
-        // There is no deduplication for these, so that might cause some cycles :/
-        shuffle(without_ip.begin(), without_ip.end(), g);
-        if (without_ip.size()) {
-            cout << "<<<< resolving " << without_ip.at(0).first << " asynchronously" << endl;
-            resolve_ns(without_ip.at(0).first);
+        // ns_resolver makes sure we don't look up the same name twice at the same time
+        if (ranking.without_ip.size()) {
+            std::uniform_int_distribution<size_t> pick(0, ranking.without_ip.size() - 1);
+            DNSName ns_name = ranking.without_ip[pick(rng())].first;
+            l.unlock();
+            resolve_ns(ns_name);
         }
-
-        return {.name = choice.first,
-                .address = choice.second,
-                .TCP = doTCP,
-                .timeout = selection_cache[choice.second].timeout,
-               };
+        return ret;
     } else {
-        cout << "EXPLORE!" << endl;
-        shuffle(servers.begin(), servers.end(), g);
-        server choice = servers.at(0);
+        // Explore: any server will do, also one we still need to find the address of
+        vector<const server*> servers;
+        for (const auto& rs : ranking.with_ip)
+            servers.push_back(&rs.s);
+        for (const auto& s : ranking.without_ip)
+            if (resolvable(s))
+                servers.push_back(&s);
+
+        if (!servers.size()) {
+            // No servers left. :(
+            throw SelectionException();
+        }
 
-        return {.name = choice.first,
-                .address = choice.second,
-                .TCP = doTCP,
-                .timeout = selection_cache[choice.second].timeout,
-               };
+        std::uniform_int_distribution<size_t> pick(0, servers.size() - 1);
+        server choice = *servers[pick(rng())];
 
+        return make_transport(choice, doTCP);
     }
 }
 
+bool Selection::get_hedge(transport choice, transport& hedge) {
+    lock_guard<mutex> l(selection_lock);
+    auto& ranking = get_ranking();
+
+    // The next-best server, which can well be the same name over the other address family
+    auto best = best_with_ip(ranking, choice.address);
+    if (!best)
+        return false;
+
+    hedge = make_transport(best->s, false);
+    return true;
+}
+
+int Selection::hedge_delay(transport choice) {
+    lock_guard<mutex> l(selection_lock);
+    time_t now = time(nullptr);
+    return server_state(choice.address, now).get_hedge_delay(now);
+}
+
+void Selection::overtaken(transport choice, int elapsed) {
+    lock_guard<mutex> l(selection_lock);
+    time_t now = time(nullptr);
+    server_state(choice.address, now).slower_than(elapsed, now);
+    rerank(choice.address);
+}
+
 void Selection::success(transport choice) {
     return;
 }
 
 void Selection::timeout(transport choice) {
-    selection_cache[choice.address].packet_lost();
+    lock_guard<mutex> l(selection_lock);
+    time_t now = time(nullptr);
+    server_state(choice.address, now).packet_lost(now);
+    rerank(choice.address);
 }
 
 void Selection::rtt(transport choice, int elapsed) {
-    cout << "Updating " << choice.address.toString() << " with " << elapsed << endl;
-    selection_cache[choice.address].update(elapsed);
+    lock_guard<mutex> l(selection_lock);
+    time_t now = time(nullptr);
+    server_state(choice.address, now).update(elapsed, now);
+    rerank(choice.address);
 }
 
 void Selection::error(transport choice, SelectionFeedback error) {
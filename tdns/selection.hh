@@ -2,12 +2,15 @@
 
 #include <random>
 #include <algorithm>
+#include <iterator>
 #include <chrono>
 #include <thread>
+#include <mutex>
 
 #include "sclasses.hh"
 #include "record-types.hh"
 #include "ns_cache.hh"
+#include "ns_resolver.hh"
 
 #include "tres.hh"
 
@@ -18,58 +21,40 @@ typedef pair<DNSName, ComboAddress> server;
 const int MILLISECOND = 1000;
 const int SECOND = 1000 * MILLISECOND;
 
-const int MIN_TIMEOUT = 1 * MILLISECOND;
+// These follow unbound, see https://github.com/NLnetLabs/unbound/blob/master/util/rtt.h
+const int MIN_TIMEOUT = 50 * MILLISECOND;
 const int MAX_TIMEOUT = 12 * SECOND;
-
-// This ought to be called as a thread and never join
-static void do_resolve_ns(DNSName ns_name)
-try
-{
-    DNSName name(ns_name);
-    vector<DNSType> types = {DNSType::A, DNSType::AAAA};
-    auto resolver = TDNSResolver(g_root);
-    for (auto type : types) {
-        auto ret = resolver.resolveAt(ns_name, type);
-        if (ret.res.size()) {
-            for(const auto& res : ret.res)
-                addr_cache[ns_name].insert(getIP(res.rr));
-        }
-    }
-}
-catch(TooManyQueriesException& e)
-{
-  cerr << "Thread died after too many queries" << endl;
-}
-catch(exception& e)
-{
-  cerr << "Thread died: " << e.what() << endl;
-}
+const int UNKNOWN_SERVER_NICENESS = 376 * MILLISECOND; // the timeout of a server we know nothing about
+const int RTT_BAND = 400 * MILLISECOND;                // servers this close to the best one are just as good
+const time_t INFRA_HOST_TTL = 900;                     // forget about a server after this many seconds of silence
+const time_t BACKOFF_DECAY = 60;                       // a backed off timeout halves every this many seconds
 
 struct GlobalServerState {
     int rtt_estimate = 0; // microseconds
-    int rtt_variance = 376 * MILLISECOND / 4;
-    int timeout = calculate_timeout();
-
-    void update(int new_rtt) {
-        int delta = rtt_estimate - new_rtt;
+    int rtt_variance = UNKNOWN_SERVER_NICENESS / 4;
+    int timeout = calculate_timeout(); // larger than calculate_timeout() if we backed off
+    time_t last_update = time(nullptr);
+    time_t lost_at = 0;   // when we last backed off
+
+    // Only call this with RTTs we are sure about: never for answers that came in after a retransmit (Karn's algorithm)
+    void update(int new_rtt, time_t now) {
+        int delta = new_rtt - rtt_estimate;
         rtt_estimate += delta/8;
         rtt_variance += (abs(delta) - rtt_variance) / 4;
         timeout = calculate_timeout();
+        last_update = now;
     }
 
-    void packet_lost() {
-        // This will get more interesting when we accept for outstanding answers after retransmit
-        // See https://github.com/NLnetLabs/unbound/blob/4bf9d124190470b8a46439f569f1e72457222930/util/rtt.c#L100 for example
-        // But in tres we can't so we don't :)
-        // So for now we just backoff exponentially
-
-        timeout *= 2;
+    // No answer, even after retransmitting, so we back off exponentially
+    // See https://github.com/NLnetLabs/unbound/blob/4bf9d124190470b8a46439f569f1e72457222930/util/rtt.c#L100 for example
+    void packet_lost(time_t now) {
+        timeout = get_timeout(now) * 2;
         if (timeout > MAX_TIMEOUT)
             timeout = MAX_TIMEOUT;
-
+        lost_at = last_update = now;
     }
 
-    int calculate_timeout() {
+    int calculate_timeout() const {
         int to = rtt_estimate + 4 * rtt_variance;
         if (to < MIN_TIMEOUT)
             return MIN_TIMEOUT;
@@ -78,16 +63,41 @@ struct GlobalServerState {
         return to;
     }
 
-    int get_timeout() {
-        if (calculate_timeout() != timeout) {
-            // we have backed off or fell back
-            return timeout;
-        }
-        return rtt_estimate + 4 * rtt_variance;
+    // With our rtt_estimate + 4 * rtt_variance timeout, this is roughly the 95th percentile
+    // of the RTTs we have seen, so the server is probably not going to answer after this
+    int get_hedge_delay(time_t now) const {
+        int delay = rtt_estimate + 2 * rtt_variance;
+        if (delay < MIN_TIMEOUT)
+            return MIN_TIMEOUT;
+        if (delay > get_timeout(now))
+            return get_timeout(now);
+        return delay;
+    }
+
+    // The server had not answered after elapsed when another one did, so its RTT is at least that
+    void slower_than(int elapsed, time_t now) {
+        if (elapsed > rtt_estimate)
+            update(elapsed, now);
+    }
+
+    // The timeout for the next query. A backoff wears off over time, so a server that was
+    // down gets another chance, instead of being avoided until we forget about it
+    int get_timeout(time_t now) const {
+        int calculated = calculate_timeout();
+        int to = timeout;
+        for (time_t t = now - lost_at; t >= BACKOFF_DECAY && to > calculated; t -= BACKOFF_DECAY)
+            to /= 2;
+        return to > calculated ? to : calculated;
+    }
+
+    bool expired(time_t now) const {
+        return now - last_update >= INFRA_HOST_TTL;
     }
 };
 
+// Shared by all threads, only touch it with selection_lock held
 extern map<ComboAddress, GlobalServerState> selection_cache;
+extern mutex selection_lock;
 
 enum SelectionFeedback {
     SOCKET,
@@ -120,6 +130,31 @@ struct LocalServerState {
     }
 };
 
+// A server, and the timeout it was ranked with
+struct RankedServer {
+    server s;
+    int timeout;
+};
+
+// The servers of a zone cut, best first. This is shared by all resolutions that talk to
+// this zone cut, so we don't have to sort the servers each time we pick one
+struct ZoneRanking {
+    shared_ptr<const ns_servers> servers; // what this ranking was built from
+    vector<RankedServer> with_ip;         // sorted on timeout
+    vector<server> without_ip;
+    unsigned int picks = 0;               // since the last full sort
+    time_t last_used = 0;
+
+    // A ranking goes when nobody asked for it in INFRA_HOST_TTL, like the server state it is sorted on,
+    // or when the ns_cache no longer hands out the server list it was built from
+    bool expired(time_t now) const {
+        return now - last_used >= INFRA_HOST_TTL || servers.use_count() == 1;
+    }
+};
+
+// Also only touch this with selection_lock held
+extern map<DNSName, ZoneRanking> zone_rankings;
+
 class Selection {
 public:
     Selection(DNSName zonecut, TDNSResolver* res) : zonecut(zonecut), resolver(res) {};
@@ -127,14 +162,25 @@ public:
     transport get_transport();
     void success(transport choice);
     void timeout(transport choice);
+    // Only for RTTs we are sure about, not after a retransmit
     void rtt(transport choice, int elapsed);
     void error(transport choice, SelectionFeedback error);
 
+    // For hedged queries: another server to ask if choice is slow, false if there is none
+    bool get_hedge(transport choice, transport& hedge);
+    // How long to wait for choice before asking the hedge, microseconds
+    int hedge_delay(transport choice);
+    // choice had not answered after elapsed microseconds, when the other server did
+    void overtaken(transport choice, int elapsed);
+
 private:
     void resolve_ns(DNSName ns_name) {
-        std::thread t(do_resolve_ns, ns_name);
-        t.detach();
+        ns_resolver.submit(ns_name);
     }
+    ZoneRanking& get_ranking();
+    void rerank(const ComboAddress& address);
+    const RankedServer* best_with_ip(ZoneRanking& ranking, const ComboAddress& skip);
+    transport make_transport(const server& s, bool tcp);
     bool doTCP = false;
 
     DNSName zonecut;
@@ -0,0 +1,78 @@
+#include "sha1.hh"
+#include <string.h>
+#include <algorithm>
+
+const uint32_t SHA1::s_init[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+SHA1::SHA1()
+{
+  memcpy(d_state, s_init, sizeof(d_state));
+}
+
+static inline uint32_t rol(uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+void SHA1::compress(uint32_t state[5], const uint8_t* block)
+{
+  uint32_t w[80];
+  for(int t = 0; t < 16; ++t)
+    w[t] = (uint32_t)block[4*t] << 24 | (uint32_t)block[4*t+1] << 16 | (uint32_t)block[4*t+2] << 8 | block[4*t+3];
+  for(int t = 16; t < 80; ++t)
+    w[t] = rol(w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16], 1);
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  // the four rounds of 20 steps differ only in their function and constant
+  auto step = [&](uint32_t f, uint32_t k, uint32_t w) {
+    uint32_t temp = rol(a, 5) + f + e + k + w;
+    e = d; d = c; c = rol(b, 30); b = a; a = temp;
+  };
+  int t = 0;
+  for(; t < 20; ++t)
+    step((b & c) | (~b & d), 0x5A827999, w[t]);
+  for(; t < 40; ++t)
+    step(b ^ c ^ d, 0x6ED9EBA1, w[t]);
+  for(; t < 60; ++t)
+    step((b & c) | (b & d) | (c & d), 0x8F1BBCDC, w[t]);
+  for(; t < 80; ++t)
+    step(b ^ c ^ d, 0xCA62C1D6, w[t]);
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+void SHA1::update(const void* data, size_t len)
+{
+  auto p = (const uint8_t*)data;
+  d_length += len;
+  while(len) {
+    size_t chunk = std::min(len, sizeof(d_block) - d_blocklen);
+    memcpy(d_block + d_blocklen, p, chunk);
+    d_blocklen += chunk;
+    p += chunk;
+    len -= chunk;
+    if(d_blocklen == sizeof(d_block)) {
+      compress(d_state, d_block);
+      d_blocklen = 0;
+    }
+  }
+}
+
+std::string SHA1::digest()
+{
+  uint64_t bits = d_length * 8;
+  uint8_t pad = 0x80;
+  update(&pad, 1);
+  pad = 0;
+  while(d_blocklen != 56)
+    update(&pad, 1);
+  uint8_t length[8];
+  for(int n = 0; n < 8; ++n)
+    length[n] = bits >> (56 - 8 * n);
+  update(length, 8);
+
+  std::string ret(20, '\0');
+  for(int n = 0; n < 20; ++n)
+    ret[n] = d_state[n / 4] >> (24 - 8 * (n % 4));
+  return ret;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/*!
+   @file
+   @brief SHA-1, which NSEC3 (RFC 5155) uses to hash names
+
+   SHA-1 is no longer fit for signatures, but NSEC3 only uses it to spread
+   names over a hash ring, and it is what every NSEC3 zone out there uses.
+   It is small enough to implement here, so tauth needs no crypto library.
+*/
+
+//! Computes a SHA-1 digest (RFC 3174) of everything passed to update()
+class SHA1
+{
+public:
+  SHA1();
+  void update(const void* data, size_t len);
+  void update(const std::string& str) { update(str.c_str(), str.size()); }
+  //! The 20 byte digest. Call this only once
+  std::string digest();
+
+  //! The state before the first block is hashed
+  static const uint32_t s_init[5];
+  //! Hashes one 64 byte block into 'state'
+  static void compress(uint32_t state[5], const uint8_t* block);
+
+private:
+  uint32_t d_state[5];
+  uint8_t d_block[64];
+  size_t d_blocklen{0};
+  uint64_t d_length{0}; //!< in bytes
+};
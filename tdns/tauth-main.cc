@@ -1,15 +1,76 @@
 #include <iostream>
+#include <functional>
+#include <chrono>
+#include <string.h>
 #include "record-types.hh"
 #include "dns-storage.hh"
 
 using namespace std;
 
-void launchDNSServer(vector<ComboAddress> locals);
+void launchDNSServer(vector<ComboAddress> locals, unsigned int udpworkers, std::function<void(DNSNode&)> load);
+extern chrono::milliseconds g_udpDelay;
+extern double g_udpLoss;
 
 int main(int argc, char** argv)
 {
+  // options come first, after that the addresses to listen on
+  unsigned int udpworkers = 1, benchzone = 0;
+  bool nsec3 = false;
+  uint16_t iterations = 0;
+  string benchparent;
+  vector<pair<DNSName, ComboAddress>> delegations;
+  int opts = 0;
+  for(; opts + 1 < argc && !strncmp(argv[opts + 1], "--", 2); ++opts) {
+    string opt(argv[opts + 1]);
+    if(opt.rfind("--udp-workers=", 0) == 0)
+      udpworkers = atoi(opt.c_str() + 14);
+    else if(opt.rfind("--bench-zone=", 0) == 0)
+      benchzone = atoi(opt.c_str() + 13);
+    else if(opt == "--nsec3")
+      nsec3 = true;
+    else if(opt.rfind("--nsec3=", 0) == 0) {
+      nsec3 = true;
+      iterations = atoi(opt.c_str() + 8);
+    }
+    else if(opt.rfind("--bench-parent=", 0) == 0)
+      benchparent = opt.substr(15);
+    else if(opt.rfind("--delegate=", 0) == 0) {
+      auto pos = opt.find(',');
+      if(pos == string::npos) {
+        cerr<<"Syntax: --delegate=zone,ip"<<endl;
+        return(EXIT_FAILURE);
+      }
+      delegations.push_back({makeDNSName(opt.substr(11, pos - 11)), ComboAddress(opt.substr(pos + 1), 53)});
+    }
+    else if(opt.rfind("--delay=", 0) == 0)
+      g_udpDelay = chrono::milliseconds(atoi(opt.c_str() + 8));
+    else if(opt.rfind("--loss=", 0) == 0)
+      g_udpLoss = atof(opt.c_str() + 7) / 100.0;
+    else if(opt == "--quiet")
+      cout.setstate(ios::failbit); // tauth logs every query, which would dominate a benchmark
+    else {
+      cerr<<"Unknown option "<<opt<<endl;
+      return(EXIT_FAILURE);
+    }
+  }
+  argc -= opts;
+  argv += opts;
+
   if(argc < 2) {
-    cerr<<"Syntax: tdns ipaddress:port [ipaddress:port] .. [[ipv6address]:port]] .."<<endl;
+    cerr<<"Syntax: tdns [options] ipaddress:port [ipaddress:port] .. [[ipv6address]:port]] .."<<endl;
+    cerr<<"\n";
+    cerr<<"Options:\n";
+    cerr<<"  --udp-workers=n    answer UDP queries with n threads per address\n";
+    cerr<<"  --bench-zone=n     instead of the usual zones, serve a generated zone\n";
+    cerr<<"                     'bench.example' with about n names\n";
+    cerr<<"  --nsec3[=n]        with --bench-zone, use NSEC3 with n extra iterations\n";
+    cerr<<"                     instead of NSEC\n";
+    cerr<<"  --bench-parent=zone instead of the usual zones, serve a generated zone\n";
+    cerr<<"                     that only delegates, use '.' for the root\n";
+    cerr<<"  --delegate=zone,ip with --bench-parent, delegate zone to a server at ip\n";
+    cerr<<"  --delay=msec       hold back UDP answers this long\n";
+    cerr<<"  --loss=percent     ignore this percentage of UDP queries\n";
+    cerr<<"  --quiet            do not log queries\n";
     return(EXIT_FAILURE);
   }
 
@@ -17,5 +78,10 @@ int main(int argc, char** argv)
   for(int n= 1; n < argc; ++n)
     locals.emplace_back(argv[n], 53);
 
-  launchDNSServer(locals);
+  if(benchzone)
+    launchDNSServer(locals, udpworkers, [=](DNSNode& zones) { generateZone(zones, {"bench", "example"}, benchzone, nsec3, iterations); });
+  else if(!benchparent.empty())
+    launchDNSServer(locals, udpworkers, [&](DNSNode& zones) { generateDelegations(zones, makeDNSName(benchparent), locals[0], delegations); });
+  else
+    launchDNSServer(locals, udpworkers, loadZones);
 }
@@ -12,6 +12,12 @@
 #include <stdexcept>
 #include "sclasses.hh"
 #include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <random>
+#include <chrono>
 #include <signal.h>
 #include "record-types.hh"
 #include "dns-storage.hh"
@@ -35,7 +41,9 @@ using namespace std;
     DNS messages also mostly have a query name, which is a DNSName and a query type which is a DNSType. They also have a DNSClass but we don't do much with that.
 
     To insert resource records into DNSMessageWriter, use DNSMessageWriter::putRR, to
-    read them from DNSMessageReader, use DNSMessageReader::getRR.
+    read them from DNSMessageReader, use DNSMessageReader::getRR. If you only
+    want some of the records, DNSMessageReader::RRView lets you look at them
+    before decoding them.
 
     Resource records are stored as RRGen instances. The RRGen object is able to serialize
     itself to/from a DNSMessageWriter or DNSMessageReader. In addition, this object has a
@@ -53,7 +61,7 @@ using namespace std;
     by the DNSNode class, for which see dns-storage.hh
 */
 
-void addAdditional(const DNSNode* bestzone, const DNSName& zone, const vector<DNSName>& toresolve, DNSMessageWriter& response);
+void addAdditional(const vector<const RRSet*>& rrsets, DNSMessageWriter& response);
 
 void reportQuery(DNSName qname, DNSClass qclass, DNSType qtype, const ComboAddress& remote);
 
@@ -179,7 +187,7 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
     if(passedZonecut) {
       response.dh.aa = false;
       cout<<"\tThis is a delegation, zonecutname: '"<<passedZonecut->getName()<<"'"<<endl;
-      vector<DNSName> toresolve;
+      vector<const RRSet*> toresolve;
 
       auto iter = passedZonecut->rrsets.find(DNSType::NS);  // is there an NS record here? should be!
       if(iter != passedZonecut->rrsets.end()) {
@@ -189,25 +197,24 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
           /* add the NS records to the authority section. Note that for this we have to make
              the name absolute again: zonecutname + zonename */
           response.putRR(DNSSection::Authority, passedZonecut->getName()+zonename, rrset.ttl, rr);
-          // and add for additional processing
-          toresolve.push_back(dynamic_cast<NSGen*>(rr.get())->d_name);
         }
+        toresolve.push_back(&rrset); // and add for additional processing
       }
       if(mustDoDNSSEC) 
         addDSToDelegation(response, passedZonecut, zonename);
       
-      addAdditional(bestzone, zonename, toresolve, response);
+      addAdditional(toresolve, response);
     }
     else if(!searchname.empty()) { // we had parts of the qname that did not match
       cout<<"\tThis is an NXDOMAIN situation, unmatched parts: "<<searchname<<", lastnode: "<<lastnode<<endl;
 
       const auto& rrset = bestzone->rrsets[DNSType::SOA]; // fetch the SOA record to indicate NXDOMAIN ttl
-      auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
+      auto ttl = min(rrset.ttl, rrset.contents.get<SOAGen>(0)->d_minimum); // 2308 3
 
       response.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
       
       if(mustDoDNSSEC) { // should do DNSSEC
-        addNXDOMAINDNSSEC(response, rrset, qname, node, passedZonecut, zonename);
+        addNXDOMAINDNSSEC(response, rrset, searchname+lastnode, lastnode, bestzone, zonename);
       }
       if(!CNAMELoopCount) // RFC 1034, 4.3.2, step 3.c
         response.dh.rcode = (int)RCode::Nxdomain;
@@ -217,17 +224,17 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
       
       decltype(node->rrsets)::const_iterator iter;
 
-      vector<DNSName> additional;
+      vector<const RRSet*> additional;
       // first we always check for a CNAME, which should be the only RRType at a node if present
       if(iter = node->rrsets.find(DNSType::CNAME), iter != node->rrsets.end()) {
         cout<<"\tCNAME"<<endl;
         const auto& rrset = iter->second;
         response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rrset.contents[0]);
         if(mustDoDNSSEC) {
-          addSignatures(response, rrset, lastnode, passedWcard, zonename);
+          addSignatures(response, rrset, lastnode, passedWcard, bestzone, zonename);
         }
 
-        DNSName target=dynamic_cast<CNAMEGen*>(rrset.contents[0].get())->d_name;
+        DNSName target=rrset.contents.get<CNAMEGen>(0)->d_name;
 
         // we'll only follow in-zone CNAMEs, which is not quite per-RFC, but a good idea
         if(target.makeRelative(zonename)) {
@@ -253,23 +260,23 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
           for(const auto& rr : rrset.contents) {
             cout<<"\tAdding a " << i2->first <<" RR\n";
             response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, rr);
-            if(i2->first == DNSType::MX)
-              additional.push_back(dynamic_cast<MXGen*>(rr.get())->d_name);
           }
+          if(!rrset.targets.empty()) // MX, NS or SRV
+            additional.push_back(&rrset);
           if(mustDoDNSSEC) 
-            addSignatures(response, rrset, lastnode, passedWcard, zonename);
+            addSignatures(response, rrset, lastnode, passedWcard, bestzone, zonename);
         }
       }
       else {
         cout<<"\tNode exists, qtype doesn't, NOERROR situation, inserting SOA"<<endl;
         const auto& rrset = bestzone->rrsets[DNSType::SOA];
-        auto ttl = min(rrset.ttl, dynamic_cast<SOAGen*>(rrset.contents[0].get())->d_minimum); // 2308 3
+        auto ttl = min(rrset.ttl, rrset.contents.get<SOAGen>(0)->d_minimum); // 2308 3
 
         response.putRR(DNSSection::Authority, zonename, ttl, rrset.contents[0]);
         if(mustDoDNSSEC) 
-          addNoErrorDNSSEC(response, node, rrset, zonename);
+          addNoErrorDNSSEC(response, node, rrset, bestzone, zonename);
       }
-      addAdditional(bestzone, zonename, additional, response);
+      addAdditional(additional, response);
     }
     return true;
   }
@@ -285,17 +292,80 @@ bool processQuestion(const DNSNode& zones, DNSMessageReader& dm, const ComboAddr
   }
 }
 
+//! UDP answers are held back this long, to simulate a server that is far away
+chrono::milliseconds g_udpDelay{0};
+//! This fraction of UDP queries is ignored, to simulate packet loss
+double g_udpLoss{0};
+
+/*! Sends UDP answers once they have been held back for g_udpDelay. Since the delay
+    is the same for every answer, they go out in the order they came in. Sending
+    happens from a thread of our own, so the UDP workers don't have to wait */
+class DelayedSender
+{
+public:
+  void send(int sock, string packet, const ComboAddress& remote)
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    if(!d_running) {
+      thread t(&DelayedSender::run, this);
+      t.detach();
+      d_running = true;
+    }
+    d_queue.push_back({chrono::steady_clock::now() + g_udpDelay, sock, std::move(packet), remote});
+    d_cond.notify_one();
+  }
+private:
+  struct Delayed
+  {
+    chrono::steady_clock::time_point when;
+    int sock;
+    string packet;
+    ComboAddress remote;
+  };
+  void run()
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    for(;;) {
+      d_cond.wait(l, [this]() { return !d_queue.empty(); });
+      if(chrono::steady_clock::now() < d_queue.front().when) {
+        d_cond.wait_until(l, d_queue.front().when);
+        continue;
+      }
+      auto d = std::move(d_queue.front());
+      d_queue.pop_front();
+      l.unlock();
+      try {
+        SSendto(d.sock, d.packet, d.remote);
+      }
+      catch(std::exception& e) {
+        cerr<<"Sending delayed answer to "<<d.remote.toStringWithPort()<<": "<<e.what()<<endl;
+      }
+      l.lock();
+    }
+  }
+  std::mutex d_lock;
+  std::condition_variable d_cond;
+  std::deque<Delayed> d_queue;
+  bool d_running{false};
+};
+
+static DelayedSender g_delayedSender;
+
 /* this is where all UDP questions come in. Note that 'zones' is const, 
    which protects us from accidentally changing anything */
 void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
 {
   DNSName qname;
   DNSType qtype;
+  std::mt19937 gen(std::random_device{}());
+  std::uniform_real_distribution<double> lossdist(0, 1);
 
   for(;;) {
     ComboAddress remote(local);
     try {
       string message = SRecvfrom(*sock, 512, remote);
+      if(g_udpLoss > 0 && lossdist(gen) < g_udpLoss)
+        continue;
       DNSMessageReader dm(message);
       dm.getQuestion(qname, qtype);
       
@@ -305,7 +375,10 @@ void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
         if(response.dh.rcode)
           cout<<"\tSending response with rcode "<<(RCode)response.dh.rcode <<endl;
         
-        SSendto(*sock, response.serialize(), remote);
+        if(g_udpDelay.count())
+          g_delayedSender.send(*sock, response.serialize(), remote);
+        else
+          SSendto(*sock, response.serialize(), remote);
       }
     }
     catch(std::exception& e) {
@@ -317,37 +390,35 @@ void udpThread(ComboAddress local, Socket* sock, const DNSNode* zones)
 /** \brief Looks up additional records
 
    This function is called to do additional processing on records we encountered 
-   earlier that would benefit. This includes MX and NS records.
+   earlier that would benefit. This includes MX, NS and SRV records.
 
-   Note that this function will only ook within 'bestzone', the best zone we had 
-   for the original query. This means we will not look at potentially helpful 
-   records in other zones. RFCs tell us that resolvers should not use/trust such
-   out of zone data anyhow, but no RFC tells us we should not add that data.
+   Note that this function will only look within the zone these records are in.
+   This means we will not look at potentially helpful records in other zones.
+   RFCs tell us that resolvers should not use/trust such out of zone data anyhow,
+   but no RFC tells us we should not add that data.
 
-   But we don't */
-void addAdditional(const DNSNode* bestzone, const DNSName& zone, const vector<DNSName>& toresolve, DNSMessageWriter& response)
+   But we don't. Which nodes are in the zone and have addresses was worked out when
+   the zone was loaded, see linkTargets(), so here we only follow pointers. */
+void addAdditional(const vector<const RRSet*>& rrsets, DNSMessageWriter& response)
 try
 {
-  for(auto addname : toresolve ) {
-    if(!addname.makeRelative(zone)) {
-      //      cout<<addname<<" is not within our zone, not doing glue"<<endl;
-      continue;
-    }
-    DNSName wuh;
-    auto addnode = bestzone->find(addname, wuh);
-    if(!addnode || !addname.empty())  {
-      continue;
-    }
-    for(auto& type : {DNSType::A, DNSType::AAAA}) {
-      auto iter2 = addnode->rrsets.find(type);
-      if(iter2 != addnode->rrsets.end()) {
-        const auto& rrset = iter2->second;
-        for(const auto& rr : rrset.contents) {
-          response.putRR(DNSSection::Additional, wuh+zone, rrset.ttl, rr);
+  for(auto rrset : rrsets) {
+    for(size_t n = 0; n < rrset->targets.size(); ++n) {
+      auto addnode = rrset->targets[n];
+      if(!addnode)
+        continue;
+      const DNSName& addname = *getTarget(rrset->contents[n]);
+      for(auto& type : {DNSType::A, DNSType::AAAA}) {
+        auto iter2 = addnode->rrsets.find(type);
+        if(iter2 != addnode->rrsets.end()) {
+          const auto& addrrset = iter2->second;
+          for(const auto& rr : addrrset.contents) {
+            response.putRR(DNSSection::Additional, addname, addrrset.ttl, rr);
+          }
         }
       }
     }
-  }  
+  }
 }
 catch(std::out_of_range& e) { // exceeded packet size
   cout<<"\tAdditional records would have overflowed the packet, stopped adding them, not truncating yet\n";
@@ -541,8 +612,9 @@ std::unique_ptr<DNSNode> retrieveZone(const ComboAddress& remote, const DNSName&
   return ret;
 }
 
-//! This is the main tdns function
-void launchDNSServer(vector<ComboAddress> locals)
+/*! This is the main tdns function. 'load' fills out the zones we serve, and each local
+    address gets 'udpworkers' threads answering UDP queries */
+void launchDNSServer(vector<ComboAddress> locals, unsigned int udpworkers, std::function<void(DNSNode&)> load)
 try
 {
   cout<<"Hello and welcome to tdns, the teaching authoritative nameserver"<<endl;
@@ -550,7 +622,9 @@ try
 
   DNSNode zones;
   cout<<"Loading & retrieving zone data"<<endl;
-  loadZones(zones);
+  load(zones);
+  linkTargets(zones);
+  indexDNSSEC(zones);
 
   auto tcploop = [&](Socket* tcplistener, const ComboAddress local) {
     cout<<"Listening on TCP on "<<local.toStringWithPort()<<endl;
@@ -563,11 +637,16 @@ try
   };
 
   for(const auto& local : locals) {
-    auto udplistener = new Socket(local.sin4.sin_family, SOCK_DGRAM);
-    SBind(*udplistener, local);
-    cout<<"Listening on UDP on "<<local.toStringWithPort()<<endl;
-    thread udpServer(udpThread, local, udplistener, &zones);
-    udpServer.detach();
+    // with SO_REUSEPORT, the kernel spreads queries over the sockets of our workers
+    for(unsigned int n = 0; n < max(1U, udpworkers); ++n) {
+      auto udplistener = new Socket(local.sin4.sin_family, SOCK_DGRAM);
+      if(udpworkers > 1)
+        SSetsockopt(*udplistener, SOL_SOCKET, SO_REUSEPORT, 1);
+      SBind(*udplistener, local);
+      thread udpServer(udpThread, local, udplistener, &zones);
+      udpServer.detach();
+    }
+    cout<<"Listening on UDP on "<<local.toStringWithPort()<<" with "<<max(1U, udpworkers)<<" threads"<<endl;
 
     auto tcplistener = new Socket(local.sin4.sin_family, SOCK_STREAM);
     SSetsockopt(*tcplistener, SOL_SOCKET, SO_REUSEPORT, 1);
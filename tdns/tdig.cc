@@ -1,24 +1,767 @@
 #include <cstdint>
 #include <vector>
 #include <map>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
 #include <stdexcept>
 #include "sclasses.hh"
 #include <thread>
 #include <signal.h>
+#include <poll.h>
+#include <string.h>
 #include "record-types.hh"
 
 /*! 
    @file
    @brief Tiny 'dig'-like utility to create DNS queries & print responses
+
+   With --load, tdig instead reads a list of queries and sends them to a
+   server as fast as it is told to, to measure how well the server keeps up.
+
+   With --replay, tdig sends the queries from a packet capture, at the pace
+   they were captured at, or faster. The outcome of a replay can be saved,
+   and compared to that of an earlier one, to find answers that changed and
+   query types that got slower.
 */
 
 using namespace std;
 
+namespace {
+
+struct LoadOptions
+{
+  string queryfile;
+  string pcapfile;                //!< replay this capture instead
+  double speed{1};                //!< replay this many times faster than captured, 0 is as fast as we can
+  string savefile, baselinefile;  //!< save the replay outcome, compare it to a saved one
+  double threshold{10};           //!< percent of latency increase we flag as a regression
+  unsigned int qps{0};            //!< 0 is as fast as we can
+  unsigned int outstanding{100};  //!< at most this many queries in flight
+  unsigned int sockets{8};
+  double duration{10};            //!< seconds
+  unsigned int timeout{2000};     //!< msec
+  bool tcp{false};
+};
+
+//! A query that is in flight on one of our sockets
+struct InFlight
+{
+  chrono::steady_clock::time_point sent;
+  uint32_t query;      //!< index in the query list
+  bool busy{false};
+};
+
+/* A socket or TCP connection of the load generator. Queries are matched to answers by ID, so
+   each socket can have at most 65536 queries in flight */
+struct LoadSocket
+{
+  LoadSocket(const ComboAddress& server, bool tcp) : sock(server.sin4.sin_family, tcp ? SOCK_STREAM : SOCK_DGRAM), inflight(65536)
+  {
+    SConnect(sock, server);
+    SetNonBlocking(sock);
+  }
+  Socket sock;
+  vector<InFlight> inflight; //!< by ID
+  uint16_t nextid{0};
+  string writebuf, readbuf;  //!< for TCP, queries we could not write yet, answers we did not read completely
+};
+
+//! One query from the query file, serialized once
+struct LoadQuery
+{
+  DNSName name;
+  DNSType type;
+  string packet;
+  uint64_t offset{0}; //!< for a replay, usec since the first query of the capture
+};
+
+//! What happened to a query of a replay
+struct QueryResult
+{
+  int rcode{-1};         //!< -1 if there was no answer
+  uint32_t usec{0};
+  size_t answer{0};      //!< hash of the answer section, without TTLs
+};
+
+/* Reads 'name type' lines, with an optional '+dnssec' to set the DO bit on that query.
+   Lines starting with # are ignored */
+vector<LoadQuery> readQueries(const string& fname)
+{
+  ifstream ifs(fname);
+  if(!ifs)
+    throw std::runtime_error("Unable to open query file '"+fname+"': "+strerror(errno));
+  vector<LoadQuery> ret;
+  string line;
+  while(getline(ifs, line)) {
+    istringstream iss(line);
+    string name, type, flag;
+    if(!(iss >> name) || name[0]=='#')
+      continue;
+    if(!(iss >> type))
+      throw std::runtime_error("Line without a type in query file: '"+line+"'");
+    bool doBit = (iss >> flag) && flag == "+dnssec";
+    LoadQuery q{makeDNSName(name), makeDNSType(type.c_str()), ""};
+    DNSMessageWriter dmw(q.name, q.type);
+    dmw.dh.rd = true;
+    dmw.setEDNS(4000, doBit);
+    q.packet = dmw.serialize();
+    ret.push_back(std::move(q));
+  }
+  if(ret.empty())
+    throw std::runtime_error("No queries in query file '"+fname+"'");
+  return ret;
+}
+
+/* Finds the payload of a UDP packet to port 53 in a captured frame, on a link of type linktype
+   (see https://www.tcpdump.org/linktypes.html). Returns false if the frame is anything else */
+bool getDNSPayload(const string& frame, uint32_t linktype, string& payload)
+try
+{
+  auto get16 = [&frame](size_t pos) {
+    return (uint16_t)(((uint8_t)frame.at(pos) << 8) + (uint8_t)frame.at(pos + 1));
+  };
+  size_t pos;
+  switch(linktype) {
+  case 0:   // BSD loopback, we look at the IP version instead of the address family
+    pos = 4;
+    break;
+  case 1: { // Ethernet, possibly with VLAN tags
+    pos = 14;
+    uint16_t ethertype = get16(12);
+    for(; ethertype == 0x8100 || ethertype == 0x88a8; pos += 4)
+      ethertype = get16(pos + 2);
+    if(ethertype != 0x0800 && ethertype != 0x86dd)
+      return false;
+    break;
+  }
+  case 12:  // raw IP
+  case 101:
+    pos = 0;
+    break;
+  case 113: // Linux 'any' device
+    pos = 16;
+    break;
+  case 276: // and its successor
+    pos = 20;
+    break;
+  default:
+    throw std::runtime_error("Unsupported link type "+to_string(linktype)+" in capture");
+  }
+
+  size_t udp;
+  int version = (uint8_t)frame.at(pos) >> 4;
+  if(version == 4) {
+    if(frame.at(pos + 9) != 17 || (get16(pos + 6) & 0x3fff)) // not UDP, or a fragment
+      return false;
+    udp = pos + (frame.at(pos) & 0x0f) * 4;
+  }
+  else if(version == 6) {
+    if(frame.at(pos + 6) != 17) // not UDP, or extension headers
+      return false;
+    udp = pos + 40;
+  }
+  else
+    return false;
+
+  uint16_t len = get16(udp + 4);
+  if(get16(udp + 2) != 53 || len < 8 || udp + len > frame.size())
+    return false;
+  payload = frame.substr(udp + 8, len - 8);
+  return true;
+}
+catch(std::out_of_range& e) // cut short by the capture length
+{
+  return false;
+}
+
+/* Reads the DNS queries to port 53 over UDP from a capture in pcap format. We make a new query
+   with DNSMessageWriter for each of them, with the same name, type, class, RD and CD bits and
+   EDNS settings. Their offsets are set to when they were captured, relative to the first one */
+vector<LoadQuery> readPcap(const string& fname)
+{
+  ifstream ifs(fname, ios::binary);
+  if(!ifs)
+    throw std::runtime_error("Unable to open capture '"+fname+"': "+strerror(errno));
+  char header[24];
+  uint32_t magic = 0;
+  if(ifs.read(header, sizeof(header)))
+    memcpy(&magic, header, 4);
+  bool swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+  bool nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+  if(!swapped && !nsec && magic != 0xa1b2c3d4)
+    throw std::runtime_error("'"+fname+"' is not a pcap file, note that pcapng is not supported");
+  auto get32 = [swapped](const char* p) {
+    uint32_t ret;
+    memcpy(&ret, p, 4);
+    return swapped ? __builtin_bswap32(ret) : ret;
+  };
+  uint32_t linktype = get32(header + 20);
+
+  vector<LoadQuery> ret;
+  char rec[16];
+  string frame, payload;
+  uint64_t first = 0;
+  while(ifs.read(rec, sizeof(rec))) {
+    uint64_t usec = get32(rec) * 1000000ULL + (nsec ? get32(rec + 4) / 1000 : get32(rec + 4));
+    frame.resize(get32(rec + 8));
+    if(frame.size() > 262144 || !ifs.read(&frame[0], frame.size()))
+      break; // the capture was cut short
+    if(!getDNSPayload(frame, linktype, payload))
+      continue;
+    try {
+      DNSMessageReader dmr(payload);
+      if(dmr.dh.qr || dmr.dh.opcode)
+        continue;
+      LoadQuery q;
+      dmr.getQuestion(q.name, q.type);
+      DNSMessageWriter dmw(q.name, q.type, dmr.d_qclass);
+      dmw.dh.rd = dmr.dh.rd;
+      dmw.dh.cd = dmr.dh.cd;
+      uint16_t bufsize;
+      bool doBit;
+      if(dmr.getEDNS(&bufsize, &doBit))
+        dmw.setEDNS(bufsize, doBit);
+      q.packet = dmw.serialize();
+      if(ret.empty())
+        first = usec;
+      q.offset = usec > first ? usec - first : 0;
+      ret.push_back(std::move(q));
+    }
+    catch(std::exception& e) { // not something we can parse, so not a query we can replay
+    }
+  }
+  if(ret.empty())
+    throw std::runtime_error("No DNS queries in capture '"+fname+"'");
+  // captures are not always in order, and we send in order of offset
+  stable_sort(ret.begin(), ret.end(), [](const LoadQuery& a, const LoadQuery& b) { return a.offset < b.offset; });
+  return ret;
+}
+
+//! Returns percentile p of sorted samples, which are in microseconds, in milliseconds
+double percentile(const vector<uint32_t>& samples, double p)
+{
+  return samples[min(samples.size() - 1, (size_t)(p / 100.0 * samples.size()))] / 1000.0;
+}
+
+//! Prints the latency percentiles of samples, which are in microseconds
+void printLatencies(vector<uint32_t>& samples)
+{
+  if(samples.empty())
+    return;
+  sort(samples.begin(), samples.end());
+  auto pct = [&samples](double p) { return percentile(samples, p); };
+  cout<<"Latency (msec): min "<<samples.front()/1000.0<<", p50 "<<pct(50)<<", p90 "<<pct(90);
+  cout<<", p99 "<<pct(99)<<", p99.9 "<<pct(99.9)<<", max "<<samples.back()/1000.0<<endl;
+}
+
+/* Sends the queries from the query file to a server, over and over again, for the duration we
+   were told to. Over UDP, we send up to 'batch' queries per system call with sendmmsg, and read
+   up to 'batch' answers per system call with recvmmsg. Over TCP, queries are pipelined on each
+   connection, and we write and read as much as the connection takes at once.
+
+   For a replay, each query of the capture is sent once, when it is due. We then also keep
+   track of what happened to every query */
+class LoadTester
+{
+public:
+  LoadTester(const LoadOptions& lo, const ComboAddress& server) :
+    d_lo(lo), d_queries(replay() ? readPcap(lo.pcapfile) : readQueries(lo.queryfile))
+  {
+    for(unsigned int n = 0; n < max(1U, lo.sockets); ++n) {
+      d_socks.emplace_back(server, lo.tcp);
+      d_pfds.push_back({d_socks.back().sock, POLLIN, 0});
+    }
+    if(replay())
+      d_results.resize(d_queries.size());
+  }
+  void run();
+  void report();
+  //! Writes the outcome of every query of a replay to fname, so a later replay can be compared to it
+  void save(const string& fname);
+  //! Compares this replay to the one saved in fname, returns false if it got slower or answers changed
+  bool compare(const string& fname);
+
+private:
+  static constexpr unsigned int batch = 64;
+
+  //! Takes the next query, gives it an ID on ls. Returns false if ls has no free IDs
+  bool nextQuery(LoadSocket& ls, string& packet);
+  void sent(LoadSocket& ls, const string& packet);
+  unsigned int sendUDP(LoadSocket& ls, unsigned int n);
+  unsigned int sendTCP(LoadSocket& ls, unsigned int n);
+  void readUDP(LoadSocket& ls);
+  void readTCP(LoadSocket& ls);
+  void processAnswer(LoadSocket& ls, const char* data, size_t len);
+  void expire();
+  bool replay() const { return !d_lo.pcapfile.empty(); }
+  //! For a replay, how many queries should have gone out by now
+  uint64_t due(chrono::steady_clock::time_point now);
+
+  const LoadOptions& d_lo;
+  vector<LoadQuery> d_queries;
+  vector<LoadSocket> d_socks;
+  vector<struct pollfd> d_pfds;
+  deque<pair<uint32_t, uint16_t>> d_sendorder; //!< socket, id, so the ones that time out first are at the front
+  uint32_t d_nextquery{0};
+  unsigned int d_outstanding{0};
+
+  vector<uint32_t> d_latencies;
+  map<RCode, uint64_t> d_rcodes;
+  uint64_t d_sent{0}, d_answered{0}, d_timeouts{0}, d_bogus{0}, d_senderrors{0};
+  chrono::steady_clock::time_point d_start;
+
+  vector<QueryResult> d_results; //!< by query, for a replay
+  uint64_t d_due{0};
+  uint64_t d_maxlate{0};         //!< usec, how far behind the capture we fell
+
+  vector<string> d_packets{batch};
+  vector<struct iovec> d_iovs{batch};
+  vector<struct mmsghdr> d_msgs{batch};
+  vector<string> d_bufs{batch, string(65535, 0)};
+};
+
+constexpr unsigned int LoadTester::batch;
+
+bool LoadTester::nextQuery(LoadSocket& ls, string& packet)
+{
+  auto& inf = ls.inflight[ls.nextid];
+  if(inf.busy) // we went round, this one is still in flight
+    return false;
+  inf.query = d_nextquery;
+  packet = d_queries[d_nextquery].packet;
+  d_nextquery = (d_nextquery + 1) % d_queries.size();
+  uint16_t id = ls.nextid++;
+  memcpy(&packet.at(0), &id, 2);
+  return true;
+}
+
+void LoadTester::sent(LoadSocket& ls, const string& packet)
+{
+  uint16_t id;
+  memcpy(&id, &packet.at(0), 2);
+  ls.inflight[id].busy = true;
+  ls.inflight[id].sent = chrono::steady_clock::now();
+  if(replay() && d_lo.speed > 0) {
+    int64_t late = chrono::duration_cast<chrono::microseconds>(ls.inflight[id].sent - d_start).count() -
+      d_queries[ls.inflight[id].query].offset / d_lo.speed;
+    d_maxlate = max<int64_t>(d_maxlate, late);
+  }
+  d_sendorder.push_back({&ls - &d_socks[0], id});
+  d_sent++;
+  d_outstanding++;
+}
+
+//! Sends at most n queries over ls, returns how many we sent
+unsigned int LoadTester::sendUDP(LoadSocket& ls, unsigned int n)
+{
+  unsigned int count = 0;
+  for(; count < min(n, batch) && nextQuery(ls, d_packets[count]); ++count) {
+    d_iovs[count] = {&d_packets[count].at(0), d_packets[count].size()};
+    memset(&d_msgs[count], 0, sizeof(d_msgs[count]));
+    d_msgs[count].msg_hdr.msg_iov = &d_iovs[count];
+    d_msgs[count].msg_hdr.msg_iovlen = 1;
+  }
+  if(!count)
+    return 0;
+  int res = sendmmsg(ls.sock, &d_msgs[0], count, 0);
+  if(res < 0) {
+    d_senderrors++;
+    res = 0;
+  }
+  for(int i = 0; i < res; ++i)
+    sent(ls, d_packets[i]);
+  // the ones we did not manage to send are not in flight, and go out next time
+  ls.nextid -= count - res;
+  d_nextquery = (d_nextquery + d_queries.size() - (count - res) % d_queries.size()) % d_queries.size();
+  return res;
+}
+
+//! Queues at most n queries on ls and writes what the connection takes, returns how many we queued
+unsigned int LoadTester::sendTCP(LoadSocket& ls, unsigned int n)
+{
+  unsigned int count = 0;
+  if(ls.writebuf.size() < 65536) { // don't queue more if the server is not reading
+    for(; count < n && nextQuery(ls, d_packets[0]); ++count) {
+      uint16_t len = htons(d_packets[0].size());
+      ls.writebuf.append((const char*)&len, 2);
+      ls.writebuf.append(d_packets[0]);
+      sent(ls, d_packets[0]);
+    }
+  }
+  if(!ls.writebuf.empty()) {
+    ssize_t res = write(ls.sock, ls.writebuf.c_str(), ls.writebuf.size());
+    if(res > 0)
+      ls.writebuf.erase(0, res);
+    else if(res < 0 && errno != EAGAIN)
+      throw std::runtime_error("Writing to TCP connection: "+string(strerror(errno)));
+  }
+  return count;
+}
+
+void LoadTester::readUDP(LoadSocket& ls)
+{
+  for(unsigned int n = 0; n < batch; ++n) {
+    d_iovs[n] = {&d_bufs[n].at(0), d_bufs[n].size()};
+    memset(&d_msgs[n], 0, sizeof(d_msgs[n]));
+    d_msgs[n].msg_hdr.msg_iov = &d_iovs[n];
+    d_msgs[n].msg_hdr.msg_iovlen = 1;
+  }
+  int res = recvmmsg(ls.sock, &d_msgs[0], batch, MSG_DONTWAIT, 0);
+  for(int n = 0; n < res; ++n)
+    processAnswer(ls, d_bufs[n].c_str(), d_msgs[n].msg_len);
+}
+
+void LoadTester::readTCP(LoadSocket& ls)
+{
+  auto& buf = d_bufs[0];
+  ssize_t res = read(ls.sock, &buf.at(0), buf.size());
+  if(res == 0)
+    throw std::runtime_error("Server closed TCP connection");
+  if(res < 0) {
+    if(errno == EAGAIN)
+      return;
+    throw std::runtime_error("Reading from TCP connection: "+string(strerror(errno)));
+  }
+  ls.readbuf.append(buf.c_str(), res);
+  size_t pos = 0;
+  while(ls.readbuf.size() - pos >= 2) {
+    uint16_t len = ((uint8_t)ls.readbuf[pos] << 8) + (uint8_t)ls.readbuf[pos + 1];
+    if(ls.readbuf.size() - pos - 2 < len)
+      break;
+    processAnswer(ls, ls.readbuf.c_str() + pos + 2, len);
+    pos += 2 + len;
+  }
+  ls.readbuf.erase(0, pos);
+}
+
+void LoadTester::processAnswer(LoadSocket& ls, const char* data, size_t len)
+try
+{
+  DNSMessageReader dmr(data, len);
+  auto& inf = ls.inflight[dmr.dh.id];
+  DNSName dn;
+  DNSType dt;
+  dmr.getQuestion(dn, dt);
+  if(!inf.busy || !(dn == d_queries[inf.query].name) || dt != d_queries[inf.query].type) {
+    d_bogus++;
+    return;
+  }
+  inf.busy = false;
+  d_outstanding--;
+  d_answered++;
+  d_rcodes[(RCode)dmr.dh.rcode]++;
+  d_latencies.push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - inf.sent).count());
+  if(!replay())
+    return;
+
+  auto& res = d_results[inf.query];
+  res.rcode = dmr.dh.rcode;
+  res.usec = d_latencies.back();
+  // TTLs go down, and the order of records may change, but the answer is the same
+  vector<string> answer;
+  DNSSection rrsection;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  while(dmr.getRR(rrsection, dn, dt, ttl, rr)) {
+    if(rrsection == DNSSection::Answer)
+      answer.push_back(dn.toString()+" "+toString(dt)+" "+rr->toString());
+  }
+  sort(answer.begin(), answer.end());
+  string all;
+  for(const auto& a : answer)
+    all += a + "\n";
+  res.answer = std::hash<string>()(all);
+}
+catch(std::exception& e)
+{
+  d_bogus++;
+}
+
+//! Anything that has been in flight for too long has timed out
+void LoadTester::expire()
+{
+  auto now = chrono::steady_clock::now();
+  auto timeout = chrono::milliseconds(d_lo.timeout);
+  while(!d_sendorder.empty()) {
+    auto& inf = d_socks[d_sendorder.front().first].inflight[d_sendorder.front().second];
+    if(inf.busy && now - inf.sent < timeout)
+      break;
+    if(inf.busy) {
+      inf.busy = false;
+      d_outstanding--;
+      d_timeouts++;
+    }
+    d_sendorder.pop_front();
+  }
+}
+
+uint64_t LoadTester::due(chrono::steady_clock::time_point now)
+{
+  if(d_lo.speed <= 0)
+    return d_queries.size();
+  double elapsed = chrono::duration_cast<chrono::microseconds>(now - d_start).count() * d_lo.speed;
+  while(d_due < d_queries.size() && d_queries[d_due].offset <= elapsed)
+    d_due++;
+  return d_due;
+}
+
+void LoadTester::run()
+{
+  d_start = chrono::steady_clock::now();
+  auto stop = d_start + chrono::microseconds((int64_t)(d_lo.duration * 1000000));
+  uint32_t nextsock = 0;
+
+  for(;;) {
+    auto now = chrono::steady_clock::now();
+    bool sending = replay() ? d_sent < d_queries.size() : now < stop;
+    if(!sending && !d_outstanding)
+      break;
+
+    // how many queries can go out now?
+    uint64_t cansend = 0;
+    if(sending && d_outstanding < d_lo.outstanding) {
+      cansend = d_lo.outstanding - d_outstanding;
+      if(replay())
+        cansend = min(cansend, due(now) - d_sent);
+      else if(d_lo.qps) {
+        uint64_t due = chrono::duration_cast<chrono::microseconds>(now - d_start).count() * d_lo.qps / 1000000 + 1;
+        cansend = min(cansend, due > d_sent ? due - d_sent : 0);
+      }
+    }
+
+    // spread the queries over our sockets, until they are all out or the sockets are full
+    for(unsigned int tries = 0; cansend && tries < d_socks.size(); ++tries) {
+      auto& ls = d_socks[nextsock];
+      nextsock = (nextsock + 1) % d_socks.size();
+      unsigned int share = d_lo.tcp ? max<uint64_t>(1, cansend / d_socks.size()) : min<uint64_t>(cansend, batch);
+      unsigned int res = d_lo.tcp ? sendTCP(ls, share) : sendUDP(ls, share);
+      cansend -= res;
+      if(res)
+        tries = 0;
+    }
+
+    for(size_t s = 0; s < d_socks.size(); ++s)
+      d_pfds[s].events = POLLIN | (d_socks[s].writebuf.empty() ? 0 : POLLOUT);
+
+    // wait for answers, but not for longer than it takes for the next query to be due
+    if(poll(&d_pfds[0], d_pfds.size(), cansend ? 0 : 1) > 0) {
+      for(size_t s = 0; s < d_socks.size(); ++s) {
+        if(d_pfds[s].revents & POLLOUT)
+          sendTCP(d_socks[s], 0);
+        if(!(d_pfds[s].revents & POLLIN))
+          continue;
+        if(d_lo.tcp)
+          readTCP(d_socks[s]);
+        else
+          readUDP(d_socks[s]);
+      }
+    }
+    expire();
+  }
+}
+
+void LoadTester::report()
+{
+  double secs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - d_start).count() / 1000000.0;
+  cout<<"Sent "<<d_sent<<" queries in "<<secs<<" seconds over "<<d_socks.size()<<(d_lo.tcp ? " TCP connections, " : " sockets, ")<<d_sent/secs<<" qps"<<endl;
+  cout<<"Answered "<<d_answered<<" ("<<d_answered/secs<<" qps), "<<d_timeouts<<" timeouts";
+  cout<<", "<<d_bogus<<" bogus answers, "<<d_senderrors<<" send errors"<<endl;
+  printLatencies(d_latencies);
+  for(const auto& r : d_rcodes)
+    cout<<"RCode "<<r.first<<": "<<r.second<<endl;
+  if(!replay())
+    return;
+
+  if(d_lo.speed > 0)
+    cout<<"Replayed "<<d_queries.size()<<" queries at "<<d_lo.speed<<" times the captured pace, at most "<<d_maxlate/1000.0<<" msec behind"<<endl;
+  map<DNSType, vector<uint32_t>> bytype;
+  map<DNSType, uint64_t> timeouts;
+  for(size_t n = 0; n < d_queries.size(); ++n) {
+    if(d_results[n].rcode < 0)
+      timeouts[d_queries[n].type]++;
+    else
+      bytype[d_queries[n].type].push_back(d_results[n].usec);
+  }
+  cout<<"Type        answers  timeouts  p50 msec  p99 msec"<<endl;
+  for(auto& t : bytype) {
+    sort(t.second.begin(), t.second.end());
+    cout<<setw(10)<<left<<toString(t.first)<<right<<setw(9)<<t.second.size()<<setw(10)<<timeouts[t.first];
+    cout<<setw(10)<<percentile(t.second, 50)<<setw(10)<<percentile(t.second, 99)<<endl;
+  }
+}
+
+void LoadTester::save(const string& fname)
+{
+  ofstream ofs(fname);
+  if(!ofs)
+    throw std::runtime_error("Unable to write '"+fname+"': "+strerror(errno));
+  ofs<<"# query name type rcode usec answer, rcode -1 is a timeout\n";
+  for(size_t n = 0; n < d_queries.size(); ++n) {
+    const auto& r = d_results[n];
+    ofs<<n<<" "<<d_queries[n].name<<" "<<toString(d_queries[n].type)<<" "<<r.rcode<<" "<<r.usec<<" "<<r.answer<<"\n";
+  }
+  if(!ofs.flush())
+    throw std::runtime_error("Unable to write '"+fname+"': "+strerror(errno));
+}
+
+/* Latencies of a query type are compared by their median and 99th percentile. An increase is a
+   regression if it is more than d_lo.threshold percent, and more than 'minincrease' usec, so
+   we don't report noise on very fast servers. Types with fewer than 'minsamples' answers in
+   either run are not judged */
+bool LoadTester::compare(const string& fname)
+{
+  constexpr uint32_t minincrease = 100;
+  constexpr size_t minsamples = 10;
+
+  ifstream ifs(fname);
+  if(!ifs)
+    throw std::runtime_error("Unable to open baseline '"+fname+"': "+strerror(errno));
+  map<DNSType, vector<uint32_t>> base, now;
+  uint64_t changed = 0, newtimeouts = 0, fixedtimeouts = 0;
+  size_t count = 0;
+  string line;
+  while(getline(ifs, line)) {
+    if(line.empty() || line[0] == '#')
+      continue;
+    istringstream iss(line);
+    size_t n;
+    string name, type;
+    QueryResult b;
+    if(!(iss >> n >> name >> type >> b.rcode >> b.usec >> b.answer))
+      throw std::runtime_error("Unparseable line in baseline '"+fname+"': '"+line+"'");
+    if(n >= d_queries.size() || name != d_queries[n].name.toString() || type != toString(d_queries[n].type))
+      throw std::runtime_error("Baseline '"+fname+"' is of a different capture");
+    count++;
+
+    const auto& r = d_results[n];
+    if(b.rcode >= 0)
+      base[d_queries[n].type].push_back(b.usec);
+    if(r.rcode >= 0)
+      now[d_queries[n].type].push_back(r.usec);
+    if(b.rcode >= 0 && r.rcode < 0)
+      newtimeouts++;
+    else if(b.rcode < 0 && r.rcode >= 0)
+      fixedtimeouts++;
+    else if(b.rcode != r.rcode || b.answer != r.answer) {
+      if(changed++ < 10) {
+        cout<<"Answer changed for "<<d_queries[n].name<<"|"<<toString(d_queries[n].type);
+        if(b.rcode != r.rcode)
+          cout<<", RCode was "<<(RCode)b.rcode<<", now "<<(RCode)r.rcode;
+        cout<<endl;
+      }
+    }
+  }
+  if(count != d_queries.size())
+    throw std::runtime_error("Baseline '"+fname+"' is of a different capture");
+  cout<<"Compared to baseline: "<<changed<<" answers changed, "<<newtimeouts<<" new timeouts, "<<fixedtimeouts<<" fewer timeouts"<<endl;
+
+  bool ok = !changed && !newtimeouts;
+  cout<<"Type       p50 base   p50 now  p99 base   p99 now"<<endl;
+  for(auto& b : base) {
+    auto& n = now[b.first];
+    cout<<setw(10)<<left<<toString(b.first)<<right;
+    if(b.second.size() < minsamples || n.size() < minsamples) {
+      cout<<"  too few answers to compare"<<endl;
+      continue;
+    }
+    sort(b.second.begin(), b.second.end());
+    sort(n.begin(), n.end());
+    bool regression = false;
+    for(double p : {50.0, 99.0}) {
+      double was = percentile(b.second, p), is = percentile(n, p);
+      cout<<setw(10)<<was<<setw(10)<<is;
+      if(is > was * (1 + d_lo.threshold / 100) && (is - was) * 1000 > minincrease)
+        regression = true;
+    }
+    cout<<(regression ? "  REGRESSION" : "")<<endl;
+    ok = ok && !regression;
+  }
+  return ok;
+}
+}
+
 int main(int argc, char** argv)
 try
 {
+  // options come first, after that the positional arguments
+  LoadOptions lo;
+  int opts = 0;
+  for(; opts + 1 < argc && !strncmp(argv[opts + 1], "--", 2); ++opts) {
+    string opt(argv[opts + 1]);
+    if(opt.rfind("--load=", 0) == 0)
+      lo.queryfile = opt.substr(7);
+    else if(opt.rfind("--replay=", 0) == 0)
+      lo.pcapfile = opt.substr(9);
+    else if(opt.rfind("--speed=", 0) == 0)
+      lo.speed = atof(opt.c_str() + 8);
+    else if(opt.rfind("--save=", 0) == 0)
+      lo.savefile = opt.substr(7);
+    else if(opt.rfind("--baseline=", 0) == 0)
+      lo.baselinefile = opt.substr(11);
+    else if(opt.rfind("--threshold=", 0) == 0)
+      lo.threshold = atof(opt.c_str() + 12);
+    else if(opt.rfind("--qps=", 0) == 0)
+      lo.qps = atoi(opt.c_str() + 6);
+    else if(opt.rfind("--outstanding=", 0) == 0)
+      lo.outstanding = atoi(opt.c_str() + 14);
+    else if(opt.rfind("--sockets=", 0) == 0)
+      lo.sockets = atoi(opt.c_str() + 10);
+    else if(opt.rfind("--duration=", 0) == 0)
+      lo.duration = atof(opt.c_str() + 11);
+    else if(opt.rfind("--timeout=", 0) == 0)
+      lo.timeout = atoi(opt.c_str() + 10);
+    else if(opt == "--tcp")
+      lo.tcp = true;
+    else {
+      cerr<<"Unknown option "<<opt<<endl;
+      return(EXIT_FAILURE);
+    }
+  }
+  argc -= opts;
+  argv += opts;
+
+  if((!lo.queryfile.empty() || !lo.pcapfile.empty()) && argc == 2) {
+    signal(SIGPIPE, SIG_IGN);
+    LoadTester lt(lo, ComboAddress(argv[1], 53));
+    lt.run();
+    lt.report();
+    if(!lo.savefile.empty())
+      lt.save(lo.savefile);
+    if(!lo.baselinefile.empty() && !lt.compare(lo.baselinefile))
+      return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+  }
+
   if(argc != 4) {
     cerr<<"Syntax: tdig name type ip[:port]"<<endl;
+    cerr<<"Syntax: tdig --load=queryfile [options] ip[:port]"<<endl;
+    cerr<<"Syntax: tdig --replay=capture.pcap [options] ip[:port]"<<endl;
+    cerr<<"\n";
+    cerr<<"With --load, tdig sends the queries in queryfile, one 'name type' per line,\n";
+    cerr<<"to the server over and over again, and reports how well it kept up.\n";
+    cerr<<"Add '+dnssec' to a line to set the DO bit on that query.\n";
+    cerr<<"\n";
+    cerr<<"With --replay, tdig sends the DNS queries over UDP in capture.pcap once,\n";
+    cerr<<"at the pace they were captured, and reports latencies per query type.\n";
+    cerr<<"\n";
+    cerr<<"Load options:\n";
+    cerr<<"  --qps=n            send n queries per second, default is as fast as possible\n";
+    cerr<<"  --outstanding=n    keep at most n queries in flight, default 100\n";
+    cerr<<"  --sockets=n        spread queries over n sockets, default 8\n";
+    cerr<<"  --tcp              use TCP, with one connection per socket\n";
+    cerr<<"  --duration=s       send for s seconds, default 10\n";
+    cerr<<"  --timeout=msec     give up on a query after this long, default 2000\n";
+    cerr<<"\n";
+    cerr<<"Replay options, and --outstanding, --sockets, --tcp and --timeout:\n";
+    cerr<<"  --speed=x          replay x times faster than captured, 0 is as fast as possible\n";
+    cerr<<"  --save=file        save the outcome of every query to file\n";
+    cerr<<"  --baseline=file    compare to an outcome saved earlier, exit with an error\n";
+    cerr<<"                     if answers changed or a query type got slower\n";
+    cerr<<"  --threshold=pct    how much slower is slower, default 10%\n";
     return(EXIT_FAILURE);
   }
   signal(SIGPIPE, SIG_IGN);
@@ -6,6 +6,24 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+static void printIPs(void* arg, int err, struct TDNSIPAddresses* ips)
+{
+  if(err) {
+    fprintf(stderr, "Error looking up %s: %s\n", (const char*)arg, TDNSErrorMessage(err));
+    return;
+  }
+  for(int n = 0; ips->addresses[n]; ++n) {
+    struct sockaddr_storage* res = ips->addresses[n];
+    char ip[INET6_ADDRSTRLEN];
+    if(res->ss_family == AF_INET)
+      inet_ntop(res->ss_family, &((struct sockaddr_in*)res)->sin_addr, ip, INET6_ADDRSTRLEN);
+    else
+      inet_ntop(res->ss_family, &((struct sockaddr_in6*)res)->sin6_addr, ip, INET6_ADDRSTRLEN);
+    printf("%s IP address: %s\n", (const char*)arg, ip);
+  }
+  freeTDNSIPAddresses(ips);
+}
+
 int main(int argc, char **argv)
 {
   struct TDNSContext* tdns = TDNSMakeContext("");
@@ -64,5 +82,10 @@ int main(int argc, char **argv)
   }
   freeTDNSTXTs(txts);
 
+  const char* names[] = {"www.dns-oarc.net", "www.isc.org", "www.powerdns.com"};
+  for(int n = 0; n < 3; ++n)
+    TDNSSubmitIPs(tdns, names[n], 1000, 1, 1, printIPs, (void*)names[n]);
+  TDNSWait(tdns);
+
   freeTDNSContext(tdns);
 }
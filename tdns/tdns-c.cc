@@ -5,6 +5,12 @@
 #include "sclasses.hh"
 #include <memory>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <list>
+#include <map>
+#include <poll.h>
 using namespace std;
 
 namespace {
@@ -21,28 +27,57 @@ struct TDNSCleanUp
     delete vec;
   }
 };
- 
-DNSMessageReader getDNSResponse(Socket& sock, const DNSName& dn, const DNSType& dt)
+
+enum TDNSError { NoError = 0, Timeout = 1, ServerFailure = 2, NoSuchDomain = 3, UnknownError = 4 };
+
+struct TDNSLookup;
+
+//! What we learned from the answer to one query, which is also what we cache
+struct TDNSAnswer
 {
+  int err{NoError};
+  uint32_t ttl{std::numeric_limits<uint32_t>::max()}; //!< max means we have no TTL and can't cache this
+  vector<ComboAddress> ips;
+  vector<pair<uint16_t, string>> mxs;
+  vector<string> txts;
+};
 
-  DNSMessageWriter dmw(dn, dt);
-  dmw.dh.rd = true;
-  dmw.randomizeID();
-  
-  SWrite(sock, dmw.serialize());
-  ComboAddress server;
-  string resp =SRecvfrom(sock, 65535, server);
-  
-  return DNSMessageReader(resp);
+struct TDNSCacheEntry
+{
+  TDNSAnswer answer;
+  chrono::steady_clock::time_point expire;
+  std::list<std::pair<DNSName, DNSType>>::iterator lru; //!< where we are in cachelru
+};
 
-}
+//! One question of a lookup, which we ask the configured servers one after the other
+struct TDNSQuery
+{
+  TDNSLookup* lookup;
+  DNSType type;
+  uint16_t id{0};
+  size_t server{0};    //!< the server we are asking now
+  size_t tries{0};     //!< how many servers we have asked so far
+  chrono::steady_clock::time_point deadline; //!< when we give up on this server
+  bool done{false};
+  TDNSAnswer answer;
+  std::string packet;  //!< the query, built once, we only change the ID for the next server
+};
 
-Socket makeResolverSocket(const ComboAddress& server)
+//! A lookup submitted by the user, which consists of one or two queries
+struct TDNSLookup
 {
-  Socket sock(server.sin4.sin_family, SOCK_DGRAM);
-  SConnect(sock, server);
-  return sock;
-}
+  enum class Kind { IPs, MXs, TXTs } kind;
+  DNSName name;
+  vector<TDNSQuery> queries;          //!< never resized after creation, we hand out pointers
+  unsigned int outstanding{0};
+  chrono::steady_clock::time_point deadline;
+  chrono::milliseconds perserver;     //!< how long we give each server
+
+  TDNSIPsCallback ipscb{nullptr};
+  TDNSMXsCallback mxscb{nullptr};
+  TDNSTXTsCallback txtscb{nullptr};
+  void* arg{nullptr};
+};
 }
 
 extern "C" {
@@ -50,18 +85,425 @@ extern "C" {
 struct TDNSContext
 {
   std::vector<ComboAddress> servers;
+  std::vector<std::unique_ptr<Socket>> socks;    //!< one per server, connected and non-blocking, null if we can't reach it
+  std::vector<struct pollfd> pollfds;            //!< for the blocking calls, one per socket
+  std::map<std::pair<size_t, uint16_t>, TDNSQuery*> inflight; //!< by server and ID
+  std::list<std::unique_ptr<TDNSLookup>> lookups;
+  std::vector<TDNSQuery*> retries;               //!< queries that need to go to the next server
+  std::string recvbuf = std::string(65535, 0);
+  std::mt19937 gen{std::random_device{}()};
+
+  std::map<std::pair<DNSName, DNSType>, TDNSCacheEntry> cache;
+  std::list<std::pair<DNSName, DNSType>> cachelru; //!< the keys of cache, most recently used first
+  size_t cachemaxentries{0};         //!< 0 means the cache is off
+  uint32_t cachemaxttl{86400};
+  uint32_t cachemaxnegttl{3600};
+};
+
+}
+
+namespace {
+
+/* Opens a socket to each server, which lives as long as the context does. Because the sockets are
+   connected, the kernel drops anything that does not come from the server, and tells us if the
+   server is unreachable. A server we can't open a socket to, for example because we have no IPv6,
+   gets skipped */
+void openSockets(TDNSContext* context)
+{
+  for(const auto& server : context->servers) {
+    std::unique_ptr<Socket> sock;
+    try {
+      sock = std::make_unique<Socket>(server.sin4.sin_family, SOCK_DGRAM);
+      SConnect(*sock, server);
+      SetNonBlocking(*sock);
+      context->pollfds.push_back({*sock, POLLIN, 0});
+    }
+    catch(std::exception& e) {
+      sock.reset();
+    }
+    context->socks.push_back(std::move(sock));
+  }
+}
+
+/* Picks an ID for q that is not in use with the server it is at. After a few random tries, we take the
+   first free one. Returns false if all 65536 IDs are in use with that server */
+bool pickID(TDNSContext* context, TDNSQuery* q)
+{
+  std::uniform_int_distribution<uint16_t> dis;
+  uint16_t id = dis(context->gen);
+  for(unsigned int n = 0; n < 8; ++n, id = dis(context->gen))
+    if(!context->inflight.count({q->server, id}))
+      break;
+  for(unsigned int n = 0; n <= std::numeric_limits<uint16_t>::max(); ++n, ++id) {
+    if(!context->inflight.count({q->server, id})) {
+      q->id = id;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Sends q to the server it is at, with a fresh ID. If that server can't be reached at all,
+   for example because we have no IPv6, or it has no IDs left, we move on to the next one.
+   Returns false if we ran out */
+bool sendQuery(TDNSContext* context, TDNSQuery* q)
+{
+  auto lookup = q->lookup;
+  for(; q->tries < context->servers.size(); ++q->tries, q->server = (q->server + 1) % context->servers.size()) {
+    const auto& sock = context->socks[q->server];
+    if(!sock || !pickID(context, q))
+      continue;
+
+    memcpy(&q->packet.at(0), &q->id, sizeof(q->id)); // same byte order as dnsheader::id
+    if(send(*sock, q->packet.c_str(), q->packet.size(), 0) < 0)
+      continue;
+    q->deadline = std::min(chrono::steady_clock::now() + lookup->perserver, lookup->deadline);
+    context->inflight[{q->server, q->id}] = q;
+    return true;
+  }
+  return false;
+}
+
+//! If we have a fresh answer for name|type in the cache, copies it to answer, with the TTL it has left
+bool cacheGet(TDNSContext* context, const DNSName& name, DNSType type, TDNSAnswer& answer)
+{
+  if(!context->cachemaxentries)
+    return false;
+  auto iter = context->cache.find({name, type});
+  if(iter == context->cache.end())
+    return false;
+  auto now = chrono::steady_clock::now();
+  if(iter->second.expire <= now) {
+    context->cachelru.erase(iter->second.lru);
+    context->cache.erase(iter);
+    return false;
+  }
+  context->cachelru.splice(context->cachelru.begin(), context->cachelru, iter->second.lru);
+  answer = iter->second.answer;
+  answer.ttl = chrono::duration_cast<chrono::seconds>(iter->second.expire - now).count();
+  return true;
+}
+
+//! Drops the least recently used entry from the cache
+void cacheEvict(TDNSContext* context)
+{
+  context->cache.erase(context->cachelru.back());
+  context->cachelru.pop_back();
+}
+
+/* Caches answers and NXDOMAINs, as long as they came with a TTL. When the cache is full, the least
+   recently used entry goes, expired or not. Expired entries we do run into are removed by cacheGet */
+void cacheStore(TDNSContext* context, const DNSName& name, DNSType type, const TDNSAnswer& answer)
+{
+  if(!context->cachemaxentries || answer.ttl == std::numeric_limits<uint32_t>::max())
+    return;
+  bool negative = answer.err == NoSuchDomain || (answer.ips.empty() && answer.mxs.empty() && answer.txts.empty());
+  uint32_t ttl = std::min(answer.ttl, negative ? context->cachemaxnegttl : context->cachemaxttl);
+  if(!ttl)
+    return;
+
+  auto expire = chrono::steady_clock::now() + chrono::seconds(ttl);
+  auto& cache = context->cache;
+  auto& lru = context->cachelru;
+  auto iter = cache.find({name, type});
+  if(iter != cache.end()) {
+    iter->second.answer = answer;
+    iter->second.expire = expire;
+    lru.splice(lru.begin(), lru, iter->second.lru);
+    return;
+  }
+  if(cache.size() >= context->cachemaxentries)
+    cacheEvict(context);
+  lru.push_front({name, type});
+  cache.insert({lru.front(), {answer, expire, lru.begin()}});
+}
+
+void finishQuery(TDNSContext* context, TDNSQuery* q, int err)
+{
+  if(q->done)
+    return;
+  auto iter = context->inflight.find({q->server, q->id});
+  if(iter != context->inflight.end() && iter->second == q)
+    context->inflight.erase(iter);
+  q->done = true;
+  q->answer.err = err;
+  q->lookup->outstanding--;
+  if(err == NoError || err == NoSuchDomain)
+    cacheStore(context, q->lookup->name, q->type, q->answer);
+}
+
+//! This server timed out or failed on us, try the next one if there is time left
+void nextServer(TDNSContext* context, TDNSQuery* q, int err)
+{
+  context->inflight.erase({q->server, q->id});
+  q->tries++;
+  q->server = (q->server + 1) % context->servers.size();
+  if(chrono::steady_clock::now() >= q->lookup->deadline || !sendQuery(context, q))
+    finishQuery(context, q, err);
+}
+
+/* Harvests the records we are looking for from an answer to q. The TTL of the answer is the lowest
+   TTL in the answer section, or for a negative answer, the negative TTL from the SOA record (RFC 2308) */
+void parseAnswer(DNSMessageReader& dmr, TDNSQuery* q)
+{
+  auto& answer = q->answer;
+  DNSMessageReader::RRView view;
+
+  // we never need the owner names, and only decode the records we use
+  while(dmr.getRR(view)) {
+    if(view.section == DNSSection::Authority && view.type == DNSType::SOA) {
+      auto rr = dmr.getContent(view);
+      answer.ttl = std::min({answer.ttl, view.ttl, dynamic_cast<SOAGen*>(rr.get())->d_minimum});
+      continue;
+    }
+    if(view.section != DNSSection::Answer)
+      continue;
+    answer.ttl = std::min(answer.ttl, view.ttl);
+    if(view.type != q->type)
+      continue;
+    auto rr = dmr.getContent(view);
+    if(view.type == DNSType::A)
+      answer.ips.push_back(dynamic_cast<AGen*>(rr.get())->getIP());
+    else if(view.type == DNSType::AAAA)
+      answer.ips.push_back(dynamic_cast<AAAAGen*>(rr.get())->getIP());
+    else if(view.type == DNSType::MX) {
+      auto mxgen = dynamic_cast<MXGen*>(rr.get());
+      answer.mxs.push_back({mxgen->d_prio, mxgen->d_name.toString()});
+    }
+    else if(view.type == DNSType::TXT)
+      answer.txts.push_back(dynamic_cast<TXTGen*>(rr.get())->toString());
+  }
+}
+
+//! The server told us it is not there, move all queries waiting for it on to the next server
+void serverUnreachable(TDNSContext* context, size_t server)
+{
+  context->retries.clear();
+  for(auto iter = context->inflight.lower_bound({server, 0}); iter != context->inflight.end() && iter->first.first == server; ++iter)
+    context->retries.push_back(iter->second);
+  for(auto q : context->retries)
+    nextServer(context, q, Timeout);
+}
+
+//! Reads all answers waiting on the socket of server
+void readAnswers(TDNSContext* context, size_t server)
+{
+  int sock = *context->socks[server];
+  auto& buf = context->recvbuf;
+  for(;;) {
+    ssize_t len = recv(sock, &buf.at(0), buf.size(), 0);
+    if(len < 0) {
+      if(errno == ECONNREFUSED)
+        serverUnreachable(context, server);
+      return; // EAGAIN, or something we can't fix anyhow
+    }
+    if((size_t)len < sizeof(dnsheader))
+      continue;
+
+    try {
+      DNSMessageReader dmr(buf.c_str(), len);
+      auto iter = context->inflight.find({server, dmr.dh.id});
+      if(iter == context->inflight.end())
+        continue; // a late answer, from a server we already gave up on
+      TDNSQuery* q = iter->second;
+      DNSName rrdn;
+      DNSType rrdt;
+      dmr.getQuestion(rrdn, rrdt);
+      if(!(rrdn == q->lookup->name) || rrdt != q->type)
+        continue;
+
+      if((RCode)dmr.dh.rcode == RCode::Nxdomain) {
+        parseAnswer(dmr, q);
+        finishQuery(context, q, NoSuchDomain);
+      }
+      else if((RCode)dmr.dh.rcode != RCode::Noerror)
+        nextServer(context, q, ServerFailure);
+      else {
+        parseAnswer(dmr, q);
+        finishQuery(context, q, NoError);
+      }
+    }
+    catch(std::exception& e) { // unparseable, the real answer might still come
+      continue;
+    }
+  }
+}
+
+TDNSLookup* newLookup(TDNSContext* context, TDNSLookup::Kind kind, const char* name, int timeoutMsec, const vector<DNSType>& types)
+{
+  auto lookup = std::make_unique<TDNSLookup>();
+  lookup->kind = kind;
+  lookup->name = makeDNSName(name);
+  auto now = chrono::steady_clock::now();
+  lookup->deadline = now + chrono::milliseconds(timeoutMsec);
+  lookup->perserver = chrono::milliseconds(std::max(1, timeoutMsec / (int)context->servers.size()));
+  lookup->queries.resize(types.size());
+  for(size_t n = 0; n < types.size(); ++n) {
+    auto& q = lookup->queries[n];
+    q.lookup = lookup.get();
+    q.type = types[n];
+    DNSMessageWriter dmw(lookup->name, q.type);
+    dmw.dh.rd = true;
+    q.packet = dmw.serialize();
+  }
+  lookup->outstanding = types.size();
+  // all queries go out at once, so A and AAAA are looked up in parallel
+  for(auto& q : lookup->queries) {
+    if(cacheGet(context, lookup->name, q.type, q.answer)) {
+      q.done = true;
+      lookup->outstanding--;
+    }
+    else if(!sendQuery(context, &q)) {
+      q.done = true;
+      q.answer.err = UnknownError;
+      lookup->outstanding--;
+    }
+  }
+  context->lookups.push_back(std::move(lookup));
+  return context->lookups.back().get();
+}
+
+//! The error of a lookup: no such domain if any query said so, otherwise an error only if all queries failed
+int lookupError(const TDNSLookup& lookup)
+{
+  int err = NoError;
+  bool success = false;
+  for(const auto& q : lookup.queries) {
+    if(q.answer.err == NoSuchDomain)
+      return NoSuchDomain;
+    if(q.answer.err)
+      err = q.answer.err;
+    else
+      success = true;
+  }
+  return success ? NoError : err;
+}
+
+//! The lowest TTL of the successful queries of lookup
+uint32_t lookupTTL(const TDNSLookup& lookup)
+{
+  uint32_t ttl = std::numeric_limits<uint32_t>::max();
+  for(const auto& q : lookup.queries)
+    if(!q.answer.err)
+      ttl = std::min(ttl, q.answer.ttl);
+  return ttl;
+}
+
+struct TDNSIPAddresses* makeIPAddresses(TDNSLookup& lookup)
+{
+  std::unique_ptr<vector<struct sockaddr_storage*>, TDNSCleanUp<struct sockaddr_storage>> sas(new vector<struct sockaddr_storage*>());
+  for(const auto& q : lookup.queries) {
+    for(const auto& ca : q.answer.ips) {
+      auto sa = new struct sockaddr_storage();
+      memcpy(sa, &ca, sizeof(ca));
+      sas->push_back(sa);
+    }
+  }
+  sas->push_back(0);
+
+  auto ret = new struct TDNSIPAddresses();
+  ret->ttl = lookupTTL(lookup);
+  ret->addresses = (struct sockaddr_storage**)(&(*sas)[0]);
+  ret->__handle = sas.get();
+  sas.release();
+  return ret;
+}
+
+struct TDNSMXs* makeMXs(TDNSLookup& lookup)
+{
+  std::unique_ptr<vector<struct TDNSMX*>, TDNSCleanUp<struct TDNSMX>> sas(new vector<struct TDNSMX*>());
+  for(const auto& mx : lookup.queries[0].answer.mxs) {
+    auto sa = new struct TDNSMX();
+    sa->priority = mx.first;
+    sa->name = strdup(mx.second.c_str());
+    sas->push_back(sa);
+  }
+  sas->push_back(0);
+
+  auto ret = new struct TDNSMXs();
+  ret->ttl = lookupTTL(lookup);
+  ret->mxs = (struct TDNSMX**)(&(*sas)[0]);
+  ret->__handle = sas.get();
+  sas.release();
+  return ret;
+}
+
+struct TDNSTXTs* makeTXTs(TDNSLookup& lookup)
+{
+  std::unique_ptr<vector<struct TDNSTXT*>, TDNSCleanUp<struct TDNSTXT>> sas(new vector<struct TDNSTXT*>());
+  for(const auto& txt : lookup.queries[0].answer.txts) {
+    auto sa = new struct TDNSTXT();
+    sa->content = strdup(txt.c_str());
+    sas->push_back(sa);
+  }
+  sas->push_back(0);
+
+  auto ret = new struct TDNSTXTs();
+  ret->ttl = lookupTTL(lookup);
+  ret->txts = (struct TDNSTXT**)(&(*sas)[0]);
+  ret->__handle = sas.get();
+  sas.release();
+  return ret;
+}
+
+//! Hands the result of a finished lookup to its callback
+void completeLookup(TDNSLookup& lookup)
+{
+  int err = lookupError(lookup);
+  switch(lookup.kind) {
+  case TDNSLookup::Kind::IPs:
+    lookup.ipscb(lookup.arg, err, err ? nullptr : makeIPAddresses(lookup));
+    break;
+  case TDNSLookup::Kind::MXs:
+    lookup.mxscb(lookup.arg, err, err ? nullptr : makeMXs(lookup));
+    break;
+  case TDNSLookup::Kind::TXTs:
+    lookup.txtscb(lookup.arg, err, err ? nullptr : makeTXTs(lookup));
+    break;
+  }
+}
+
+//! Waits for answers or a timeout, whichever comes first, and processes what happened
+void waitAndProcess(TDNSContext* context)
+{
+  int timeout = TDNSGetTimeout(context);
+  if(timeout) // not if there are answers from the cache waiting
+    poll(context->pollfds.data(), context->pollfds.size(), timeout);
+  TDNSProcess(context);
+}
+
+//! Result of a blocking lookup, filled out by the callback
+template<typename T>
+struct TDNSBlockingResult
+{
+  bool done{false};
+  int err{UnknownError};
+  T* res{nullptr};
+
+  static void callback(void* arg, int err, T* res)
+  {
+    auto us = (TDNSBlockingResult<T>*)arg;
+    us->done = true;
+    us->err = err;
+    us->res = res;
+  }
 };
 
+}
+
+extern "C" {
+
 struct TDNSContext* TDNSMakeContext (const char* servers)
+try
 {
   auto ret = std::make_unique<TDNSContext>();
 
   if(!servers || !*servers) {
     ifstream ifs("/etc/resolv.conf");
 
-    if(!ifs) 
+    if(!ifs)
       return 0;
-    string line;    
+    string line;
     while(std::getline(ifs, line)) {
       auto pos = line.find_last_not_of(" \r\n\x1a");
       if(pos != string::npos)
@@ -73,7 +515,7 @@ struct TDNSContext* TDNSMakeContext (const char* servers)
       pos = line.find_first_of(";#");
       if(pos != string::npos)
         line.resize(pos);
-      
+
       if(line.rfind("nameserver ", 0)==0 || line.rfind("nameserver\t", 0) == 0) {
         pos = line.find_first_not_of(" ", 11);
         if(pos != string::npos) {
@@ -86,14 +528,25 @@ struct TDNSContext* TDNSMakeContext (const char* servers)
       }
     }
   }
-  else {
-    ret->servers.push_back(ComboAddress(servers, 53));
+  else { // one or more addresses, separated by commas or spaces
+    string server;
+    istringstream iss(servers);
+    while(std::getline(iss, server, ',')) {
+      istringstream words(server);
+      while(words >> server)
+        ret->servers.push_back(ComboAddress(server, 53));
+    }
   }
   if(ret->servers.empty()) {
     return 0;
   }
+  openSockets(ret.get());
   return ret.release();
 }
+catch(...)
+{
+  return 0;
+}
 
 void freeTDNSContext(struct TDNSContext* tdc)
 {
@@ -105,121 +558,159 @@ const char* TDNSErrorMessage(int err)
   static constexpr int size = sizeof(errors)/sizeof(errors[0]);
 
   if(err >= size)
-    err = size-1; 
+    err = size-1;
   return errors[err];
 };
 
-
-void freeTDNSIPAddresses(struct TDNSIPAddresses*vec)
+int TDNSSubmitIPs(struct TDNSContext* context, const char* name, int timeoutMsec, int lookupIPv4, int lookupIPv6, TDNSIPsCallback cb, void* arg)
+try
 {
-  auto ptr = (vector<struct sockaddr_storage*>*) vec->__handle;
-  TDNSCleanUp<struct sockaddr_storage>()(ptr);
-  delete vec;
-}
-
-int TDNSLookupIPs(TDNSContext* context, const char* name, int timeoutMsec, int lookupIPv4, int lookupIPv6,  struct TDNSIPAddresses** ret)
-{
-  Socket sock = makeResolverSocket(context->servers[0]);
   vector<DNSType> dtypes;
   if(lookupIPv4)
     dtypes.push_back(DNSType::A);
   if(lookupIPv6)
     dtypes.push_back(DNSType::AAAA);
-  DNSName dn = makeDNSName(name);
+  auto lookup = newLookup(context, TDNSLookup::Kind::IPs, name, timeoutMsec, dtypes);
+  lookup->ipscb = cb;
+  lookup->arg = arg;
+  return 0;
+}
+catch(...)
+{
+  return UnknownError;
+}
 
-  std::unique_ptr<vector<struct sockaddr_storage*>, TDNSCleanUp<struct sockaddr_storage>> sas(new vector<struct sockaddr_storage*>());
-  uint32_t resttl = std::numeric_limits<uint32_t>::max();
-  
-  for(const auto& dt : dtypes) {
-    DNSMessageReader dmr = getDNSResponse(sock, dn, dt);
-    DNSName rrdn;
-    DNSType rrdt;
-
-    dmr.getQuestion(rrdn, rrdt);
-    if(dmr.dh.rcode) {
-      return 3; 
-    }
-    //    cout<<"Received response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<rrdn<<", qtype "<<rrdt<<endl;
-      
-    std::unique_ptr<RRGen> rr;
-
-
-    DNSSection rrsection;
-    uint32_t rrttl;
-    
-    while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
-      if(rrttl < resttl)
-        resttl = rrttl;
-      //      cout << rrsection << " " << rrdn<< " IN " << rrdt << " " << rrttl << " " <<rr->toString()<<endl;
-      if(rrsection != DNSSection::Answer || rrdt != dt)
-        continue;
-      ComboAddress ca;
-      if(dt == DNSType::A) {
-        auto agen =dynamic_cast<AGen*>(rr.get());
-        ca = agen->getIP();
-      }
-      else {
-        auto agen =dynamic_cast<AAAAGen*>(rr.get());
-        ca = agen->getIP();
-      }
-      auto sa = new struct sockaddr_storage();
-      memcpy(sa, &ca, sizeof(ca));
-      sas->push_back(sa);
-    }
-  }
-  sas->push_back(0);
+int TDNSSubmitMXs(struct TDNSContext* context, const char* name, int timeoutMsec, TDNSMXsCallback cb, void* arg)
+try
+{
+  auto lookup = newLookup(context, TDNSLookup::Kind::MXs, name, timeoutMsec, {DNSType::MX});
+  lookup->mxscb = cb;
+  lookup->arg = arg;
+  return 0;
+}
+catch(...)
+{
+  return UnknownError;
+}
 
-  *ret = new struct TDNSIPAddresses();
-  (*ret)->ttl = resttl;
-  (*ret)->addresses = (struct sockaddr_storage**)(&(*sas)[0]);
-  (*ret)->__handle = sas.get();
-  sas.release();
+int TDNSSubmitTXTs(struct TDNSContext* context, const char* name, int timeoutMsec, TDNSTXTsCallback cb, void* arg)
+try
+{
+  auto lookup = newLookup(context, TDNSLookup::Kind::TXTs, name, timeoutMsec, {DNSType::TXT});
+  lookup->txtscb = cb;
+  lookup->arg = arg;
   return 0;
 }
+catch(...)
+{
+  return UnknownError;
+}
 
-int TDNSLookupMXs(TDNSContext* context, const char* name, int timeoutMsec, struct TDNSMXs** ret)
+int TDNSGetFDs(struct TDNSContext* context, int* fds, int maxfds)
 {
-  Socket sock = makeResolverSocket(context->servers[0]);
+  int ret = 0;
+  for(const auto& pfd : context->pollfds)
+    if(ret < maxfds)
+      fds[ret++] = pfd.fd;
+  return ret;
+}
 
-  std::unique_ptr<vector<struct TDNSMX*>, TDNSCleanUp<struct TDNSMX>> sas(new vector<struct TDNSMX*>());
-  uint32_t resttl = std::numeric_limits<uint32_t>::max();
-  DNSName dn = makeDNSName(name);
-  DNSMessageReader dmr = getDNSResponse(sock, dn, DNSType::MX);
-  DNSName rrdn;
-  DNSType rrdt;
-
-  dmr.getQuestion(rrdn, rrdt);
-      
-  //  cout<<"Received response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<rrdn<<", qtype "<<rrdt<<endl;
-      
-  std::unique_ptr<RRGen> rr;
-  DNSSection rrsection;
-  uint32_t rrttl;
-  
-  while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
-    if(rrttl < resttl)
-      resttl = rrttl;
-    //    cout << rrsection << " " << rrdn<< " IN " << rrdt << " " << rrttl << " " <<rr->toString()<<endl;
-    if(rrsection != DNSSection::Answer || rrdt != DNSType::MX)
-        continue;
-    if(rrdt == DNSType::MX) {
-        auto mxgen =dynamic_cast<MXGen*>(rr.get());
-        auto sa = new struct TDNSMX();
-        sa->priority = mxgen->d_prio;
-        sa->name = strdup(mxgen->d_name.toString().c_str());
-        sas->push_back(sa);
-    }
+int TDNSGetTimeout(struct TDNSContext* context)
+{
+  for(const auto& lookup : context->lookups)
+    if(!lookup->outstanding)
+      return 0;
+  if(context->inflight.empty())
+    return context->lookups.empty() ? -1 : 0;
+  auto first = context->inflight.begin()->second->deadline;
+  for(const auto& i : context->inflight)
+    first = std::min(first, i.second->deadline);
+  auto left = chrono::duration_cast<chrono::milliseconds>(first - chrono::steady_clock::now()).count() + 1;
+  return left > 0 ? left : 0;
+}
+
+int TDNSProcess(struct TDNSContext* context)
+try
+{
+  for(size_t n = 0; n < context->socks.size(); ++n)
+    if(context->socks[n])
+      readAnswers(context, n);
+
+  auto now = chrono::steady_clock::now();
+  auto& timedout = context->retries;
+  timedout.clear();
+  for(const auto& i : context->inflight)
+    if(i.second->deadline <= now)
+      timedout.push_back(i.second);
+  for(auto q : timedout)
+    nextServer(context, q, Timeout);
+
+  // callbacks can submit new lookups, so we take the finished ones out first. Splicing does not allocate
+  std::list<std::unique_ptr<TDNSLookup>> finished;
+  for(auto iter = context->lookups.begin(); iter != context->lookups.end(); ) {
+    auto next = std::next(iter);
+    if(!(*iter)->outstanding)
+      finished.splice(finished.end(), context->lookups, iter);
+    iter = next;
   }
-  sas->push_back(0);
+  for(auto& lookup : finished)
+    completeLookup(*lookup);
+  return context->lookups.size();
+}
+catch(...)
+{
+  return context->lookups.size();
+}
 
-  *ret = new struct TDNSMXs();
-  (*ret)->ttl = resttl;
-  (*ret)->mxs = (struct TDNSMX**)(&(*sas)[0]);
-  (*ret)->__handle = sas.get();
-  sas.release();
+void TDNSSetCache(struct TDNSContext* context, unsigned int maxEntries, unsigned int maxTTL, unsigned int maxNegativeTTL)
+{
+  context->cachemaxentries = maxEntries;
+  context->cachemaxttl = maxTTL;
+  context->cachemaxnegttl = maxNegativeTTL;
+  while(context->cache.size() > maxEntries)
+    cacheEvict(context);
+}
+
+int TDNSWait(struct TDNSContext* context)
+{
+  while(!context->lookups.empty())
+    waitAndProcess(context);
   return 0;
 }
 
+void freeTDNSIPAddresses(struct TDNSIPAddresses*vec)
+{
+  auto ptr = (vector<struct sockaddr_storage*>*) vec->__handle;
+  TDNSCleanUp<struct sockaddr_storage>()(ptr);
+  delete vec;
+}
+
+int TDNSLookupIPs(TDNSContext* context, const char* name, int timeoutMsec, int lookupIPv4, int lookupIPv6,  struct TDNSIPAddresses** ret)
+{
+  TDNSBlockingResult<struct TDNSIPAddresses> res;
+  int err = TDNSSubmitIPs(context, name, timeoutMsec, lookupIPv4, lookupIPv6, TDNSBlockingResult<struct TDNSIPAddresses>::callback, &res);
+  if(err)
+    return err;
+  while(!res.done)
+    waitAndProcess(context);
+  if(!res.err)
+    *ret = res.res;
+  return res.err;
+}
+
+int TDNSLookupMXs(TDNSContext* context, const char* name, int timeoutMsec, struct TDNSMXs** ret)
+{
+  TDNSBlockingResult<struct TDNSMXs> res;
+  int err = TDNSSubmitMXs(context, name, timeoutMsec, TDNSBlockingResult<struct TDNSMXs>::callback, &res);
+  if(err)
+    return err;
+  while(!res.done)
+    waitAndProcess(context);
+  if(!res.err)
+    *ret = res.res;
+  return res.err;
+}
+
 void freeTDNSMXs(struct TDNSMXs* vec)
 {
   auto ptr = (vector<struct TDNSMX*>*) vec->__handle;
@@ -234,44 +725,15 @@ void freeTDNSMXs(struct TDNSMXs* vec)
 
 int TDNSLookupTXTs(TDNSContext* context, const char* name, int timeoutMsec, struct TDNSTXTs** ret)
 {
-  Socket sock = makeResolverSocket(context->servers[0]);
-
-  std::unique_ptr<vector<struct TDNSTXT*>, TDNSCleanUp<struct TDNSTXT>> sas(new vector<struct TDNSTXT*>());
-  uint32_t resttl = std::numeric_limits<uint32_t>::max();
-  DNSName dn = makeDNSName(name);
-  DNSMessageReader dmr = getDNSResponse(sock, dn, DNSType::TXT);
-  DNSName rrdn;
-  DNSType rrdt;
-
-  dmr.getQuestion(rrdn, rrdt);
-      
-  //  cout<<"Received response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<rrdn<<", qtype "<<rrdt<<endl;
-      
-  std::unique_ptr<RRGen> rr;
-  DNSSection rrsection;
-  uint32_t rrttl;
-  
-  while(dmr.getRR(rrsection, rrdn, rrdt, rrttl, rr)) {
-    if(rrttl < resttl)
-      resttl = rrttl;
-    //    cout << rrsection << " " << rrdn<< " IN " << rrdt << " " << rrttl << " " <<rr->toString()<<endl;
-    if(rrsection != DNSSection::Answer || rrdt != DNSType::TXT)
-        continue;
-    if(rrdt == DNSType::TXT) {
-        auto txtgen =dynamic_cast<TXTGen*>(rr.get());
-        auto sa = new struct TDNSTXT();
-        sa->content = strdup(txtgen->toString().c_str());
-        sas->push_back(sa);
-    }
-  }
-  sas->push_back(0);
-
-  *ret = new struct TDNSTXTs();
-  (*ret)->ttl = resttl;
-  (*ret)->txts = (struct TDNSTXT**)(&(*sas)[0]);
-  (*ret)->__handle = sas.get();
-  sas.release();
-  return 0;
+  TDNSBlockingResult<struct TDNSTXTs> res;
+  int err = TDNSSubmitTXTs(context, name, timeoutMsec, TDNSBlockingResult<struct TDNSTXTs>::callback, &res);
+  if(err)
+    return err;
+  while(!res.done)
+    waitAndProcess(context);
+  if(!res.err)
+    *ret = res.res;
+  return res.err;
 }
 
 void freeTDNSTXTs(struct TDNSTXTs* vec)
@@ -285,6 +747,6 @@ void freeTDNSTXTs(struct TDNSTXTs* vec)
   delete ptr;
   delete vec;
 }
-  
-  
+
+
 }
@@ -67,6 +67,35 @@ struct TDNSTXTs
 int TDNSLookupTXTs(struct TDNSContext*, const char* name, int timeoutMsec, struct TDNSTXTs** ret);
 void freeTDNSTXTs(struct TDNSTXTs*);
 
+/* Caches at most maxEntries answers in this context, for their TTL but at most maxTTL seconds.
+   NXDOMAIN and 'no records of this type' answers are cached for at most maxNegativeTTL seconds.
+   Lookups that can be answered from the cache do not go to the network. 0 entries turns the
+   cache off, which is the default */
+void TDNSSetCache(struct TDNSContext*, unsigned int maxEntries, unsigned int maxTTL, unsigned int maxNegativeTTL);
+
+/* Asynchronous lookups. Any number of lookups can be submitted on a context. The callback
+   of a lookup is called from TDNSProcess() once it is done, with an error code, and a result
+   if the error code is 0. The callback owns that result and must free it.
+
+   To fit this into an event loop, wait until one of the file descriptors from TDNSGetFDs() is
+   readable, or until TDNSGetTimeout() milliseconds have passed, and then call TDNSProcess(). */
+typedef void (*TDNSIPsCallback)(void* arg, int err, struct TDNSIPAddresses* ips);
+typedef void (*TDNSMXsCallback)(void* arg, int err, struct TDNSMXs* mxs);
+typedef void (*TDNSTXTsCallback)(void* arg, int err, struct TDNSTXTs* txts);
+
+int TDNSSubmitIPs(struct TDNSContext*, const char* name, int timeoutMsec, int lookupIPv4, int lookupIPv6, TDNSIPsCallback cb, void* arg);
+int TDNSSubmitMXs(struct TDNSContext*, const char* name, int timeoutMsec, TDNSMXsCallback cb, void* arg);
+int TDNSSubmitTXTs(struct TDNSContext*, const char* name, int timeoutMsec, TDNSTXTsCallback cb, void* arg);
+
+/* Stores at most maxfds file descriptors to wait on in fds, returns how many there are */
+int TDNSGetFDs(struct TDNSContext*, int* fds, int maxfds);
+/* Milliseconds until TDNSProcess() needs to be called anyhow, -1 if nothing is going on */
+int TDNSGetTimeout(struct TDNSContext*);
+/* Reads answers, moves on to the next server where needed, calls callbacks. Returns the number of lookups in progress */
+int TDNSProcess(struct TDNSContext*);
+/* Runs until all lookups are done */
+int TDNSWait(struct TDNSContext*);
+
   
 #ifdef __cplusplus
 }
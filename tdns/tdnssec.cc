@@ -1,5 +1,9 @@
 #include "tdnssec.hh"
+#include "record-types.hh"
+#include "sha1.hh"
 #include <iostream>
+#include <algorithm>
+#include <string.h>
 
 using namespace std;
 
@@ -17,31 +21,66 @@ void addDSToDelegation(DNSMessageWriter& response, const DNSNode* passedZonecut,
   }
 }
 
-void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRSet& rrset, const DNSName& zonename)
+//! Adds the NSEC (or NSEC3) record at 'node', and its signatures, with 'owner' as name
+static void addNSEC(DNSMessageWriter& response, const DNSNode* node, const DNSName& owner, uint32_t ttl, DNSType type = DNSType::NSEC)
+{
+  const auto& nsecrr = node->rrsets.find(type)->second;
+  cout<<"\tAdding "<<type<<" at "<<owner<<" & signatures (have "<<nsecrr.signatures.size()<<")"<<endl;
+  response.putRR(DNSSection::Authority, owner, ttl, nsecrr.contents[0]);
+  for(const auto& sig : nsecrr.signatures) {
+    response.putRR(DNSSection::Authority, owner, ttl, sig);
+  }
+}
+
+//! The node of the NSEC3 record that matches the hash of 'name', or covers it if 'cover' is set
+static const DNSNode* findNSEC3(const DNSSECIndex& index, const DNSName& name, bool cover)
+{
+  auto node = getNSEC3(index, hashNSEC3(name, index.nsec3salt, index.nsec3iterations), cover);
+  cout<<"\t"<<(node ? "Found" : "No")<<" NSEC3 that "<<(cover ? "covers " : "matches ")<<name<<endl;
+  return node;
+}
+
+//! Adds the NSEC3 record at 'node', if any, and its signatures
+static void addNSEC3(DNSMessageWriter& response, const DNSNode* node, const DNSName& zonename)
+{
+  if(node)
+    addNSEC(response, node, DNSName({node->d_name}) + zonename, node->rrsets.find(DNSType::NSEC3)->second.ttl, DNSType::NSEC3);
+}
+
+void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRSet& rrset, const DNSNode* bestzone, const DNSName& zonename)
 {
   cout<<"\tAdding signatures for SOA (have "<<rrset.signatures.size()<<")"<<endl;
   for(const auto& sig : rrset.signatures) {
     response.putRR(DNSSection::Authority, zonename, rrset.ttl, sig);
   }
   
-  if(node->rrsets.count(DNSType::NSEC)) {
-    const auto& nsecrr = *node->rrsets.find(DNSType::NSEC);
-    cout<<"\tAdding NSEC & signatures (have "<<nsecrr.second.signatures.size()<<")"<<endl;
-    
-    response.putRR(DNSSection::Authority, node->getName()+zonename, rrset.ttl, nsecrr.second.contents[0]);
-    for(const auto& sig : nsecrr.second.signatures) {
-      response.putRR(DNSSection::Authority, node->getName()+zonename, rrset.ttl, sig);
-    }
+  if(bestzone->dnssec && !bestzone->dnssec->nsec3s.empty()) { // the NSEC3 of the name lists its types
+    addNSEC3(response, findNSEC3(*bestzone->dnssec, node->getName()+zonename, false), zonename);
+  }
+  else if(node->rrsets.count(DNSType::NSEC)) {
+    addNSEC(response, node, node->getName()+zonename, rrset.ttl);
+  }
+  else if(bestzone->dnssec) { // an empty non-terminal, the NSEC that covers it proves it has no types
+    DNSName owner;
+    auto nsecnode = getCoveringNSEC(*bestzone->dnssec, node->getName(), owner);
+    addNSEC(response, nsecnode, owner+zonename, rrset.ttl);
   }
 }
 
-void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName& lastnode, const DNSNode* passedWcard, const DNSName& zonename)
+void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName& lastnode, const DNSNode* passedWcard, const DNSNode* bestzone, const DNSName& zonename)
 {
   for(const auto& sig : rrset.signatures) {
     response.putRR(DNSSection::Answer, lastnode+zonename, rrset.ttl, sig);
   }
             
-  if(passedWcard) {
+  if(passedWcard && bestzone->dnssec && !bestzone->dnssec->nsec3s.empty()) {
+    // prove the name one label below the closest encloser does not exist (RFC 5155, 7.2.6)
+    DNSName nextcloser(lastnode);
+    while(nextcloser.size() > passedWcard->getName().size())
+      nextcloser.pop_front();
+    addNSEC3(response, findNSEC3(*bestzone->dnssec, nextcloser+zonename, true), zonename);
+  }
+  else if(passedWcard) {
     cout<<"\tAdding the wildcard NSEC at "<<passedWcard->getName()<<endl;
     auto nseciter = passedWcard->rrsets.find(DNSType::NSEC);
     if(nseciter != passedWcard->rrsets.end()) {
@@ -54,33 +93,187 @@ void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName
   }
 }
 
-void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNSName& qname, const DNSNode* node, const DNSNode* passedZonecut, const DNSName& zonename)
+/* The NSEC that covers qname proves it does not exist, and the one that covers the wildcard
+   at its closest encloser proves no wildcard could have matched it (RFC 4035, 3.1.3.2). These
+   may be the same NSEC. The closest encloser might be an empty non-terminal. */
+void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNSName& qname, const DNSName& closest, const DNSNode* bestzone, const DNSName& zonename)
 {
   for(const auto& sig : rrset.signatures) {
-    response.putRR(DNSSection::Authority, passedZonecut->getName()+zonename, rrset.ttl, sig);
+    response.putRR(DNSSection::Authority, zonename, rrset.ttl, sig);
   }
-        
-  cout<<"\tAt the last node, we have "<< node->children.size()<< " children\n";
-  cout<<"\tLast node left "<<qname.back()<<endl;
-  
-  auto place = node->children.lower_bound(qname.back());
-  cout<<"\tplace: "<<place->getName()<<endl;
-  
-  auto prev = place->prev();
-  for(;;) {
-    if(!prev) {
-      cout<<"\tNSEC should maybe loop? there is no previous???"<<endl;
+  if(!bestzone->dnssec) {
+    cout<<"\tZone has no NSEC records, can't prove NXDOMAIN"<<endl;
+    return;
+  }
+  if(!bestzone->dnssec->nsec3s.empty()) {
+    /* The closest encloser proof (RFC 5155, 7.2.2): the NSEC3 that matches the closest
+       encloser, the one that covers the next closer name, and the one that covers the
+       wildcard at the closest encloser */
+    const auto& index = *bestzone->dnssec;
+    DNSName nextcloser(qname);
+    while(nextcloser.size() > closest.size() + 1)
+      nextcloser.pop_front();
+    const DNSNode* proof[3] = {findNSEC3(index, closest+zonename, false),
+                               findNSEC3(index, nextcloser+zonename, true),
+                               findNSEC3(index, DNSName({"*"})+closest+zonename, true)};
+    for(int n = 0; n < 3; ++n)
+      if(std::find(proof, proof + n, proof[n]) == proof + n) // these may be the same
+        addNSEC3(response, proof[n], zonename);
+    return;
+  }
+
+  DNSName owner, wildowner;
+  auto nsecnode = getCoveringNSEC(*bestzone->dnssec, qname, owner);
+  addNSEC(response, nsecnode, owner+zonename, nsecnode->rrsets.find(DNSType::NSEC)->second.ttl);
+
+  auto wildnode = getCoveringNSEC(*bestzone->dnssec, DNSName({"*"})+closest, wildowner);
+  if(wildnode != nsecnode)
+    addNSEC(response, wildnode, wildowner+zonename, wildnode->rrsets.find(DNSType::NSEC)->second.ttl);
+}
+
+const DNSNode* getCoveringNSEC(const DNSSECIndex& index, const DNSName& name, DNSName& owner)
+{
+  // the last NSEC owner that is not after name. The apex is first, and comes before every name in the zone
+  auto iter = std::upper_bound(index.nsecs.begin(), index.nsecs.end(), name, [](const DNSName& a, const pair<DNSName, const DNSNode*>& b) {
+      return a.canonCompare(b.first);
+    });
+  if(iter != index.nsecs.begin())
+    --iter;
+  owner = iter->first;
+  return iter->second;
+}
+
+const DNSNode* getNSEC3(const DNSSECIndex& index, const std::string& hash, bool cover)
+{
+  auto cmp = [](const pair<string, const DNSNode*>& a, const string& b) { return a.first < b; };
+  auto iter = std::lower_bound(index.nsec3s.begin(), index.nsec3s.end(), hash, cmp);
+  if(!cover)
+    return (iter != index.nsec3s.end() && iter->first == hash) ? iter->second : 0;
+  if(iter != index.nsec3s.end() && iter->first == hash) // it exists, so nothing covers it
+    return 0;
+  if(iter == index.nsec3s.begin()) // before the first hash, covered by the last that wraps around
+    iter = index.nsec3s.end();
+  return (--iter)->second;
+}
+
+/* Hashing goes first over the name and salt, and then 'iterations' times over the previous
+   digest and salt. Usually both fit in a single SHA-1 block, in which case we set up the
+   padding once, and only compress. Otherwise we take the slow way */
+std::string hashNSEC3(const DNSName& name, const std::string& salt, uint16_t iterations)
+{
+  auto lower = [](char c) { return (c >= 'A' && c <= 'Z') ? (char)(c + 0x20) : c; };
+  size_t len = 1;
+  for(const auto& l : name)
+    len += 1 + l.size();
+
+  if(len + salt.size() > 55 || 20 + salt.size() > 55) {
+    string digest;
+    for(const auto& l : name) { // in canonical form, so lowercase
+      digest.append(1, (char)l.size());
+      for(const auto& c : l.d_s)
+        digest.append(1, lower(c));
     }
-    cout<<"\tNSEC should start at "<<prev->getName()<<endl;
-    if(!prev->rrsets.count(DNSType::NSEC)) {
-      cout<<"\tCould not find NSEC record at "<<prev->getName()<<", it is an ENT, going back further"<<endl;
+    digest.append(1, '\0');
+    for(int n = 0; n <= iterations; ++n) {
+      SHA1 sha;
+      sha.update(digest);
+      sha.update(salt);
+      digest = sha.digest();
     }
-    break;
+    return digest;
+  }
+
+  uint8_t block[64];
+  auto pad = [&block](size_t len) {
+    block[len] = 0x80;
+    memset(block + len + 1, 0, 55 - len);
+    uint64_t bits = len * 8;
+    for(int n = 0; n < 8; ++n)
+      block[56 + n] = bits >> (56 - 8 * n);
+  };
+  uint8_t* p = block;
+  for(const auto& l : name) {
+    *p++ = l.size();
+    for(const auto& c : l.d_s)
+      *p++ = lower(c);
   }
-  const auto& nsecrr = prev->rrsets.find(DNSType::NSEC);
-  cout<<"\tAdding NSEC & signatures (have "<<nsecrr->second.signatures.size()<<")"<<endl;
-  response.putRR(DNSSection::Authority, prev->getName()+zonename, nsecrr->second.ttl, nsecrr->second.contents[0]);
-  for(const auto& sig : nsecrr->second.signatures) {
-    response.putRR(DNSSection::Authority, prev->getName()+zonename, nsecrr->second.ttl, sig);
+  *p++ = 0;
+  memcpy(p, salt.c_str(), salt.size());
+  pad(len + salt.size());
+  uint32_t state[5];
+  memcpy(state, SHA1::s_init, sizeof(state));
+  SHA1::compress(state, block);
+
+  if(iterations) {
+    memcpy(block + 20, salt.c_str(), salt.size());
+    pad(20 + salt.size());
+  }
+  for(int n = 0; n < iterations; ++n) {
+    for(int i = 0; i < 20; ++i)
+      block[i] = state[i / 4] >> (24 - 8 * (i % 4));
+    memcpy(state, SHA1::s_init, sizeof(state));
+    SHA1::compress(state, block);
+  }
+
+  string ret(20, '\0');
+  for(int i = 0; i < 20; ++i)
+    ret[i] = state[i / 4] >> (24 - 8 * (i % 4));
+  return ret;
+}
+
+//! Adds the NSEC3 records of the zone at 'apex' to 'index', these are all just below the apex
+static void indexNSEC3s(DNSSECIndex& index, const DNSNode* apex)
+{
+  for(const auto& child : apex->children) {
+    auto iter = child.rrsets.find(DNSType::NSEC3);
+    if(iter == child.rrsets.end() || iter->second.contents.empty())
+      continue;
+    string hash;
+    if(!fromBase32Hex(child.d_name.d_s, hash) || hash.size() != 20)
+      continue;
+    auto nsec3 = iter->second.contents.get<NSEC3Gen>(0);
+    if(!nsec3)
+      continue;
+    if(index.nsec3s.empty()) { // all NSEC3 records in a zone have the same parameters
+      index.nsec3salt = nsec3->d_salt;
+      index.nsec3iterations = nsec3->d_iterations;
+    }
+    index.nsec3s.push_back({hash, &child});
+  }
+  sort(index.nsec3s.begin(), index.nsec3s.end());
+}
+
+//! Adds the nodes with NSEC records below 'node', called 'name', to 'index'
+static void indexNSECs(DNSSECIndex& index, const DNSNode* node, const DNSName& name)
+{
+  if(node->rrsets.count(DNSType::NSEC))
+    index.nsecs.push_back({name, node});
+  for(const auto& child : node->children) {
+    DNSName childname(name);
+    childname.push_front(child.d_name);
+    indexNSECs(index, &child, childname);
+  }
+}
+
+void indexDNSSEC(DNSNode& zones)
+{
+  if(zones.zone && zones.zone->rrsets.count(DNSType::NSEC)) {
+    auto index = std::make_unique<DNSSECIndex>();
+    indexNSECs(*index, zones.zone.get(), {});
+    sort(index->nsecs.begin(), index->nsecs.end(), [](const pair<DNSName, const DNSNode*>& a, const pair<DNSName, const DNSNode*>& b) {
+        return a.first.canonCompare(b.first);
+      });
+    cout<<"Indexed "<<index->nsecs.size()<<" NSEC records of "<<zones.getName()<<endl;
+    zones.zone->dnssec = std::move(index);
+  }
+  else if(zones.zone) {
+    auto index = std::make_unique<DNSSECIndex>();
+    indexNSEC3s(*index, zones.zone.get());
+    if(!index->nsec3s.empty()) {
+      cout<<"Indexed "<<index->nsec3s.size()<<" NSEC3 records of "<<zones.getName()<<endl;
+      zones.zone->dnssec = std::move(index);
+    }
   }
+  for(const auto& child : zones.children)
+    indexDNSSEC(const_cast<DNSNode&>(child));
 }
@@ -3,7 +3,15 @@
 #include "dns-storage.hh"
 
 void addDSToDelegation(DNSMessageWriter& response, const DNSNode* passedZonecut, const DNSName& zonename);
-void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRSet& rrset, const DNSName& zonename);
-void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName& lastnode, const DNSNode* passedWcard, const DNSName& zonename);
-void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNSName& qname, const DNSNode* node, const DNSNode* passedZonecut, const DNSName& zonename);
+void addNoErrorDNSSEC(DNSMessageWriter& response, const DNSNode* node, const RRSet& rrset, const DNSNode* bestzone, const DNSName& zonename);
+void addSignatures(DNSMessageWriter& response, const RRSet& rrset, const DNSName& lastnode, const DNSNode* passedWcard, const DNSNode* bestzone, const DNSName& zonename);
+void addNXDOMAINDNSSEC(DNSMessageWriter& response, const RRSet& rrset, const DNSName& qname, const DNSName& closest, const DNSNode* bestzone, const DNSName& zonename);
+//! Builds the DNSSECIndex of all signed zones in 'zones'
+void indexDNSSEC(DNSNode& zones);
+//! The node with the NSEC record that covers 'name', which is relative to the zone. 'owner' is set to its name
+const DNSNode* getCoveringNSEC(const DNSSECIndex& index, const DNSName& name, DNSName& owner);
 
+//! The NSEC3 record whose hash is 'hash', or that covers it if 'cover' is set, or 0 if there is none
+const DNSNode* getNSEC3(const DNSSECIndex& index, const std::string& hash, bool cover);
+//! The NSEC3 hash of name (RFC 5155, section 5), 20 bytes
+std::string hashNSEC3(const DNSName& name, const std::string& salt, uint16_t iterations);
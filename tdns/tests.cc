@@ -2,6 +2,10 @@
 #include "ext/catch/catch.hpp"
 #include "dnsmessages.hh"
 #include "dns-storage.hh"
+#include "record-types.hh"
+#include "tdnssec.hh"
+#include "nsec_cache.hh"
+#include "sha1.hh"
 
 using namespace std;
 
@@ -53,6 +57,35 @@ TEST_CASE("DNSName operations", "[dnsname]") {
   REQUIRE(unrelated.isPartOf(Org));
 }
 
+TEST_CASE("DNSName canonical ordering", "[dnsname]") {
+  // the example from RFC 4034, section 6.1, \001 and \200 are single octet labels
+  vector<DNSName> names{{"example"}, {"a", "example"}, {"yljkjljk", "a", "example"},
+                        {"Z", "a", "example"}, {"zABC", "a", "EXAMPLE"}, {"z", "example"},
+                        {std::string(1, '\x01'), "z", "example"}, {"*", "z", "example"},
+                        {std::string(1, '\x80'), "z", "example"}};
+
+  for(size_t n = 0; n + 1 < names.size(); ++n) {
+    REQUIRE(names[n].canonCompare(names[n+1]));
+    REQUIRE(!names[n+1].canonCompare(names[n]));
+  }
+  REQUIRE(!names[3].canonCompare(DNSName({"z", "A", "Example"})));
+  REQUIRE(DNSName().canonCompare(names[0]));
+}
+
+TEST_CASE("Enum names", "[enums]") {
+  for(const auto& t : enumtypemapDNSType) {
+    REQUIRE(string(toString(t.first)) == t.second);
+    REQUIRE(makeDNSType(t.second) == t.first);
+  }
+  REQUIRE(string(toString(RCode::Nxdomain)) == "Nxdomain");
+  REQUIRE(string(toString(DNSSection::Additional)) == "Additional");
+  REQUIRE(string(toString((DNSType)1000)) == "?");
+  REQUIRE(string(toString((DNSType)4)) == "?");
+  REQUIRE_THROWS(makeDNSType("BOGUS"));
+  REQUIRE_THROWS(makeDNSType(""));
+  REQUIRE_THROWS(makeRCode("Nxdomainx"));
+}
+
 TEST_CASE("DNS Messages", "[dnsmessage]") {
   DNSName qname({"www", "powerdns", "com"}), rname;
   DNSType rtype;
@@ -64,3 +97,225 @@ TEST_CASE("DNS Messages", "[dnsmessage]") {
   REQUIRE(rname == qname);
   REQUIRE(rtype == DNSType::SOA);
 }
+
+TEST_CASE("RR views", "[dnsmessage]") {
+  DNSName qname({"www", "example"}), target({"WWW", "Example", "net"});
+  DNSMessageWriter dmw(qname, DNSType::A);
+  dmw.putRR(DNSSection::Answer, qname, 3600, CNAMEGen::make({"www", "example", "net"}));
+  dmw.putRR(DNSSection::Answer, {"www", "example", "net"}, 300, AGen::make("192.0.2.1"));
+  dmw.putRR(DNSSection::Authority, {"example", "net"}, 3600, SOAGen::make({"ns1", "example", "net"}, {"admin", "example", "net"}, 1));
+  DNSMessageReader dmr(dmw.serialize());
+
+  DNSMessageReader::RRView rr;
+  REQUIRE(dmr.getRR(rr));
+  REQUIRE(rr.section == DNSSection::Answer);
+  REQUIRE(rr.type == DNSType::CNAME);
+  REQUIRE(dmr.ownerIs(rr, qname));
+  REQUIRE(!dmr.ownerIs(rr, target));
+
+  REQUIRE(dmr.getRR(rr));
+  REQUIRE(rr.type == DNSType::A);
+  REQUIRE(rr.ttl == 300);
+  REQUIRE(rr.rdlength == 4);
+  REQUIRE(dmr.rdata(rr)[3] == 1);
+  REQUIRE(dmr.ownerIs(rr, target)); // compressed, and case insensitive
+  REQUIRE(!dmr.ownerIs(rr, {"example", "net"}));
+  REQUIRE(dmr.getOwner(rr) == target);
+
+  REQUIRE(dmr.getRR(rr));
+  REQUIRE(rr.section == DNSSection::Authority);
+  auto soa = dmr.getContent(rr);
+  REQUIRE(soa->toString() == "ns1.example.net. admin.example.net. 1 10800 3600 604800 3600");
+  REQUIRE(!dmr.getRR(rr));
+}
+
+TEST_CASE("NSEC records", "[records]") {
+  DNSName qname({"a", "example"}), next({"host", "example"});
+  DNSMessageWriter dmw(qname, DNSType::A);
+  dmw.putRR(DNSSection::Authority, qname, 3600, NSECGen::make(next, {DNSType::A, DNSType::MX, DNSType::RRSIG, DNSType::NSEC, DNSType::CAA}));
+  DNSMessageReader dmr(dmw.serialize());
+
+  DNSSection section;
+  DNSName name;
+  DNSType type;
+  uint32_t ttl;
+  std::unique_ptr<RRGen> rr;
+  REQUIRE(dmr.getRR(section, name, type, ttl, rr));
+  auto nsec = dynamic_cast<NSECGen*>(rr.get());
+  REQUIRE(nsec);
+  REQUIRE(nsec->d_next == next);
+  REQUIRE(nsec->d_types == std::set<DNSType>({DNSType::A, DNSType::MX, DNSType::RRSIG, DNSType::NSEC, DNSType::CAA}));
+  REQUIRE(nsec->toString() == "host.example. A MX RRSIG NSEC CAA");
+}
+
+TEST_CASE("Additional processing targets", "[dnsnode]") {
+  DNSNode zones;
+  DNSName zonename({"example", "com"});
+  auto zone = std::make_unique<DNSNode>();
+  zone->addRRs(NSGen::make({"ns1", "example", "com"}), NSGen::make({"ns1", "example", "net"}));
+  zone->add({"ns1"})->addRRs(AGen::make("192.0.2.53"));
+  zone->add({"mail"})->addRRs(AAAAGen::make("2001:db8::25"));
+  zone->add({"www"})->addRRs(MXGen::make(10, {"MAIL", "example", "com"}), MXGen::make(20, {"nosuch", "example", "com"}));
+  zone->add({"_sip", "_udp"})->addRRs(std::make_unique<SRVGen>(0, 0, 5060, DNSName({"mail", "example", "com"})),
+                                      std::make_unique<SRVGen>(0, 0, 5060, DNSName({"www", "example", "com"})));
+  auto apex = zone.get();
+  zones.add(zonename)->zone = std::move(zone);
+
+  linkTargets(zones);
+  const auto& ns = apex->rrsets[DNSType::NS];
+  REQUIRE(ns.targets.size() == 2);
+  REQUIRE(ns.targets[0] == apex->add({"ns1"}));
+  REQUIRE(!ns.targets[1]); // out of zone
+  const auto& mx = apex->add({"www"})->rrsets.at(DNSType::MX);
+  REQUIRE(mx.targets.size() == 2);
+  REQUIRE(mx.targets[0] == apex->add({"mail"}));
+  REQUIRE(*getTarget(mx.contents[0]) == DNSName({"mail", "example", "com"}));
+  REQUIRE(!mx.targets[1]); // does not exist
+  const auto& srv = apex->add({"_sip", "_udp"})->rrsets.at(DNSType::SRV);
+  REQUIRE(srv.targets.size() == 2);
+  REQUIRE(srv.targets[0] == apex->add({"mail"}));
+  REQUIRE(!srv.targets[1]); // exists, but has no addresses
+}
+
+TEST_CASE("NSEC index", "[dnssec]") {
+  DNSNode zones;
+  DNSName zonename({"example", "com"});
+  auto zone = std::make_unique<DNSNode>();
+  zone->addRRs(NSECGen::make({"a", "example", "com"}, {DNSType::SOA, DNSType::NSEC}));
+  zone->add({"a"})->addRRs(NSECGen::make({"b", "c", "example", "com"}, {DNSType::A, DNSType::NSEC}));
+  zone->add({"b", "c"})->addRRs(NSECGen::make({"z", "example", "com"}, {DNSType::A, DNSType::NSEC})); // c is an empty non-terminal
+  zone->add({"z"})->addRRs(NSECGen::make(zonename, {DNSType::A, DNSType::NSEC}));
+  auto apex = zone.get();
+  zones.add(zonename)->zone = std::move(zone);
+
+  indexDNSSEC(zones);
+  REQUIRE(apex->dnssec);
+  REQUIRE(apex->dnssec->nsecs.size() == 4);
+
+  auto covering = [apex](const DNSName& name) {
+    DNSName owner;
+    auto node = getCoveringNSEC(*apex->dnssec, name, owner);
+    REQUIRE(node == apex->add(owner));
+    return owner;
+  };
+  REQUIRE(covering({"b"}) == DNSName({"a"}));
+  REQUIRE(covering({"c"}) == DNSName({"a"}));
+  REQUIRE(covering({"*", "c"}) == DNSName({"a"}));
+  REQUIRE(covering({"x", "c"}) == DNSName({"b", "c"}));
+  REQUIRE(covering({"d", "e", "f"}) == DNSName({"b", "c"}));
+  REQUIRE(covering({"zz"}) == DNSName({"z"}));
+  REQUIRE(covering({"A", "A"}) == DNSName({"a"}));
+}
+
+TEST_CASE("NSEC cache", "[dnssec]") {
+  NSECCache cache;
+  DNSName zone({"example", "com"});
+  cache.store(zone, zone, NSECGen({"b", "example", "com"}, {DNSType::SOA, DNSType::NS, DNSType::NSEC}), 3600);
+  cache.store(zone, {"b", "example", "com"}, NSECGen({"d", "example", "com"}, {DNSType::A, DNSType::NSEC}), 3600);
+  cache.store(zone, {"d", "example", "com"}, NSECGen({"m", "example", "com"}, {DNSType::NS, DNSType::NSEC}), 3600); // a delegation
+  cache.store(zone, {"m", "example", "com"}, NSECGen(zone, {DNSType::A, DNSType::NSEC}), 3600);
+  cache.store(zone, {"x", "example", "net"}, NSECGen({"y", "example", "net"}, {DNSType::A}), 3600); // not of this zone
+
+  REQUIRE(cache.lookup({"c", "example", "com"}, DNSType::A) == NSECCache::Result::Nxdomain);
+  REQUIRE(cache.lookup({"z", "example", "com"}, DNSType::A) == NSECCache::Result::Nxdomain); // after the last NSEC
+  REQUIRE(cache.lookup({"c", "b", "example", "com"}, DNSType::A) == NSECCache::Result::Nxdomain);
+  REQUIRE(cache.lookup({"b", "example", "com"}, DNSType::AAAA) == NSECCache::Result::Nodata);
+  REQUIRE(cache.lookup({"b", "example", "com"}, DNSType::A) == NSECCache::Result::Unknown);
+  REQUIRE(cache.lookup({"x", "d", "example", "com"}, DNSType::A) == NSECCache::Result::Unknown); // in the child zone
+  REQUIRE(cache.lookup({"d", "example", "com"}, DNSType::A) == NSECCache::Result::Unknown);
+  REQUIRE(cache.lookup({"x", "example", "net"}, DNSType::AAAA) == NSECCache::Result::Unknown);
+  REQUIRE(cache.d_nxdomains == 3);
+  REQUIRE(cache.d_nodatas == 1);
+
+  // b.example.org is covered, but we know nothing about *.example.org, which might exist
+  DNSName other({"example", "org"});
+  cache.store(other, {"a", "example", "org"}, NSECGen({"c", "example", "org"}, {DNSType::A, DNSType::NSEC}), 3600);
+  REQUIRE(cache.lookup({"b", "example", "org"}, DNSType::A) == NSECCache::Result::Unknown);
+  cache.store(other, other, NSECGen({"a", "example", "org"}, {DNSType::SOA, DNSType::NSEC}), 3600);
+  REQUIRE(cache.lookup({"b", "example", "org"}, DNSType::A) == NSECCache::Result::Nxdomain);
+
+  // records with a TTL of 0 are expired right away
+  cache.store(other, {"c", "example", "org"}, NSECGen({"e", "example", "org"}, {DNSType::A, DNSType::NSEC}), 0);
+  REQUIRE(cache.lookup({"d", "example", "org"}, DNSType::A) == NSECCache::Result::Unknown);
+  REQUIRE(cache.lookup({"c", "example", "org"}, DNSType::AAAA) == NSECCache::Result::Unknown);
+}
+
+TEST_CASE("NSEC3 hashing", "[dnssec]") {
+  auto hex = [](const std::string& in) {
+    std::string ret;
+    char buf[3];
+    for(const auto& c : in) {
+      snprintf(buf, sizeof(buf), "%02x", (unsigned char)c);
+      ret += buf;
+    }
+    return ret;
+  };
+  SHA1 empty;
+  REQUIRE(hex(empty.digest()) == "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+  SHA1 abc;
+  abc.update("abc");
+  REQUIRE(hex(abc.digest()) == "a9993e364706816aba3e25717850c26c9cd0d89d");
+  SHA1 twoblocks;
+  twoblocks.update("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq");
+  REQUIRE(hex(twoblocks.digest()) == "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+  // RFC 5155, Appendix A
+  std::string salt("\xaa\xbb\xcc\xdd");
+  REQUIRE(toBase32Hex(hashNSEC3({"example"}, salt, 12)) == "0p9mhaveqvm6t7vbl5lop2u3t2rp3tom");
+  REQUIRE(toBase32Hex(hashNSEC3({"a", "example"}, salt, 12)) == "35mthgpgcu1qg68fab165klnsnk3dpvl");
+  REQUIRE(toBase32Hex(hashNSEC3({"NS1", "Example"}, salt, 12)) == "2t7b4g4vsa5smi47k61mv5bv1a22bojr");
+
+  // a salt this long takes the slow path
+  std::string longsalt(40, 'x'), digest = std::string(1, 7) + "example" + '\0';
+  for(int n = 0; n < 3; ++n) {
+    SHA1 sha;
+    sha.update(digest);
+    sha.update(longsalt);
+    digest = sha.digest();
+  }
+  REQUIRE(hashNSEC3({"example"}, longsalt, 2) == digest);
+
+  std::string decoded;
+  REQUIRE(fromBase32Hex("0P9MHAVEQVM6T7VBL5LOP2U3T2RP3TOM", decoded));
+  REQUIRE(decoded == hashNSEC3({"example"}, salt, 12));
+  std::string invalid;
+  REQUIRE(!fromBase32Hex("0p9mhaveqvm6t7vbl5lop2u3t2rp3toz", invalid));
+
+  DNSMessageWriter dmw({"example"}, DNSType::A);
+  dmw.putRR(DNSSection::Authority, {"0p9mhaveqvm6t7vbl5lop2u3t2rp3tom", "example"}, 3600,
+            NSEC3Gen::make(12, salt, decoded, {DNSType::NS, DNSType::SOA, DNSType::RRSIG}));
+  DNSMessageReader dmr(dmw.serialize());
+  DNSMessageReader::RRView rr;
+  REQUIRE(dmr.getRR(rr));
+  REQUIRE(dmr.getContent(rr)->toString() == "1 0 12 aabbccdd 0p9mhaveqvm6t7vbl5lop2u3t2rp3tom NS SOA RRSIG");
+}
+
+TEST_CASE("RRList storage", "[records]") {
+  RRSet rrset;
+  rrset.add(AGen::make("192.0.2.1"));
+  rrset.add(AGen::make("192.0.2.2"));
+  REQUIRE(rrset.contents.size() == 2);
+  REQUIRE(rrset.contents.getType() == DNSType::A);
+  REQUIRE(rrset.contents[1].get<AGen>());
+  REQUIRE(!rrset.contents[1].get<AAAAGen>());
+  REQUIRE(rrset.contents[1]->toString() == "192.0.2.2");
+
+  // writing from an RRList gives the same message as writing the RRGen itself
+  DNSName name({"www", "example"});
+  DNSMessageWriter a(name, DNSType::A), b(name, DNSType::A);
+  for(const auto& rr : rrset.contents)
+    a.putRR(DNSSection::Answer, name, 3600, rr);
+  b.putRR(DNSSection::Answer, name, 3600, AGen::make("192.0.2.1"));
+  b.putRR(DNSSection::Answer, name, 3600, AGen::make("192.0.2.2"));
+  REQUIRE(a.serialize() == b.serialize());
+
+  // a record of another class makes the list store pointers, which must keep working
+  RRList txts;
+  txts.add(TXTGen::make({"hello"}));
+  txts.add(ClockTXTGen::make("%Y"));
+  REQUIRE(txts.size() == 2);
+  REQUIRE(txts[0].get<TXTGen>());
+  REQUIRE(!txts[1].get<TXTGen>());
+  REQUIRE(txts[1].get<ClockTXTGen>());
+  REQUIRE(txts[0]->toString() == "\"hello\"");
+}
@@ -8,11 +8,16 @@
 #include "record-types.hh"
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
 #include "nlohmann/json.hpp"
 #include <systemd/sd-daemon.h>
 
 #include "ns_cache.hh"
 #include "selection.hh"
+#include "upstream.hh"
+#include "answer_cache.hh"
+#include "nsec_cache.hh"
 
 #include "tres.hh"
 
@@ -26,29 +31,14 @@ using namespace std;
 ComboAddress ip4_src = ComboAddress("0.0.0.0:0");
 ComboAddress ip6_src = ComboAddress("[::]:0");
 
-int ip4_port = 1023;
-int ip6_port = 1023;
-
-int get_next_ip4_port() {
-  ip4_port++;
-  if (ip4_port >= 65535)
-    ip4_port = 1024;
-  return ip4_port;
-}
-
-int get_next_ip6_port() {
-  ip6_port++;
-  if (ip6_port >= 65535)
-    ip6_port = 1024;
-  return ip6_port;
-}
-
 //! this is a different kind of error: we KNOW your name does not exist
 struct NxdomainException{};
 //! Or if your type does not exist
 struct NodataException{};
 
 multimap<DNSName, ComboAddress> g_root;
+bool g_hedge{false};
+bool g_qnameMinimisation{false};
 
 /** This function guarantees that you will get an answer from this server. It will drop EDNS for you
     and eventually it will even fall back to TCP for you. If nothing works, an exception is thrown.
@@ -56,106 +46,120 @@ multimap<DNSName, ComboAddress> g_root;
     Only the TC bit is checked.
 
     This function does check if the ID field of the response matches the query, but the caller should
-    check qname and qtype.
+    check qname and qtype. Over UDP, answers that do not match our ID, qname and qtype are ignored
+    while we wait for the real one, see udpExchange().
+
+    Over UDP, the query is sent up to 'tries' times, waiting 'timeout' seconds after each. If 'sent' is
+    passed, it tells how often that happened, which matters for RTT measurements.
 */
-DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, double timeout, bool doTCP, int depth)
+DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, double timeout, bool doTCP, int depth, unsigned int tries, unsigned int* sent)
 {
   std::string prefix(depth, ' ');
   prefix += dn.toString() + "|"+toString(dt)+" ";
 
-  bool doEDNS=true;
-
-  if(++d_numqueries > d_maxqueries) // there is the possibility our algorithm will loop
-    throw TooManyQueriesException(); // and send out thousands of queries, so let's not
-
   DNSMessageWriter dmw(dn, dt);
-  dmw.dh.rd = false;
-  dmw.randomizeID();
-  if(doEDNS)
-    dmw.setEDNS(1500, false);  // no DNSSEC for now, 1500 byte buffer size
-  string resp;
+  setupQuery(dmw);
+  DNSMessageReader dmr;
+  if(sent)
+    *sent = 1;
 
   if(doTCP) {
-    Socket sock(server.sin4.sin_family, SOCK_STREAM);
-    if (server.isIPv4()) {
-      if (ip4_src != ComboAddress("0.0.0.0:0")) {
-        ip4_src.setPort(get_next_ip4_port());
-        SBind(sock, ip4_src);
-      }
-    } else {
-      if (ip6_src != ComboAddress("[::]:0")) {
-        ip6_src.setPort(get_next_ip6_port());
-        SBind(sock, ip6_src);
-      }
+    // a pooled connection, which may already be carrying queries for others
+    int err;
+    try {
+      err = tcpExchange(server, dmw, timeout, dmr);
     }
-    SConnect(sock, server);
-    string ser = dmw.serialize();
-    uint16_t len = htons(ser.length());
-    string tmp((char*)&len, 2);
-    SWrite(sock, tmp);
-    SWrite(sock, ser);
-
-    int err = waitForData(sock, &timeout);
-
-    if( err <= 0) {
-      if(!err) d_numtimeouts++;
-      throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string(strerror(errno)): string("Timeout")));
+    catch (const std::runtime_error &) {
+      // Parse error
+      throw SelectionFeedback(INVALID_ANSWER);
     }
-
-    tmp=SRead(sock, 2);
-    len = ntohs(*((uint16_t*)tmp.c_str()));
-
-    // so yes, you need to check for a timeout here again!
-    err = waitForData(sock, &timeout);
-
     if( err <= 0) {
-      if(!err) d_numtimeouts++;
-      throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string(strerror(errno)): string("Timeout")));
+      if(!err) {
+        d_numtimeouts++;
+        throw SelectionFeedback(TIMEOUT);
+      }
+      throw SelectionFeedback(SOCKET);
     }
-    // and even this is not good enough, an authoritative server could be trickling us bytes
-    resp = SRead(sock, len);
   }
   else {
-    Socket sock(server.sin4.sin_family, SOCK_DGRAM);
-    if (server.isIPv4()) {
-      if (ip4_src != ComboAddress("0.0.0.0:0")) {
-        ip4_src.setPort(get_next_ip4_port());
-        SBind(sock, ip4_src);
-      }
-    } else {
-      if (ip6_src != ComboAddress("[::]:0")) {
-        ip6_src.setPort(get_next_ip6_port());
-        SBind(sock, ip6_src);
-      }
-    }
-    SConnect(sock, server);
-    SWrite(sock, dmw.serialize());
-
-    int err = waitForData(sock, &timeout);
+    // a pooled socket, which is already bound to a random source port
+    auto sock = g_udppool.acquire(server.sin4.sin_family);
+    int err = udpExchange(sock, server, dmw, timeout, dmr, tries, sent);
 
-    // so one could simply retry on a timeout, but here we don't
     if( err <= 0) {
-
       if(!err) {
         d_numtimeouts++;
         throw SelectionFeedback(TIMEOUT);
       }
       throw SelectionFeedback(SOCKET);
-      // throw std::runtime_error("Error waiting for data from "+server.toStringWithPort()+": "+ (err ? string(strerror(errno)): string("Timeout")));
     }
-    ComboAddress ign=server;
-    resp = SRecvfrom(sock, 65535, ign);
   }
 
+  checkResponse(dmr, dmw.dh.id, prefix);
+  return dmr;
+}
+
+/** Like getResponse() over UDP, but if server has not answered after hedgeDelay seconds, the same
+    question also goes to hedge. Whichever answers first wins, and 'winner' is set to 0 for server
+    and 1 for hedge, also if the answer turns out to be unusable. 'hedged' tells if the second
+    query was actually sent. The timeout counts from when the first query went out.
+*/
+DNSMessageReader TDNSResolver::getResponseHedged(const ComboAddress& server, const ComboAddress& hedge, const DNSName& dn, const DNSType& dt, double hedgeDelay, double timeout, int& winner, bool& hedged, int depth)
+{
+  std::string prefix(depth, ' ');
+  prefix += dn.toString() + "|"+toString(dt)+" ";
+
+  winner = -1;
+  hedged = false;
+  DNSMessageWriter dmw(dn, dt), hedgedmw(dn, dt);
+  setupQuery(dmw);
   DNSMessageReader dmr;
-  try {
-    dmr = DNSMessageReader(resp);
+
+  auto sock = g_udppool.acquire(server.sin4.sin_family);
+  std::vector<UDPPending> pending{{sock, server, dmw}};
+  udpSend(pending[0]);
+  int res = udpWaitAny(pending, std::min(hedgeDelay, timeout), dmr);
+
+  if(res == -1 && hedgeDelay < timeout) {
+    lstream() << prefix << "No answer after "<<(int)(hedgeDelay*1000)<<" msec, also asking "<<hedge.toString()<<endl;
+    setupQuery(hedgedmw);
+    auto hedgesock = g_udppool.acquire(hedge.sin4.sin_family);
+    pending.push_back({hedgesock, hedge, hedgedmw});
+    udpSend(pending[1]);
+    hedged = true;
+    res = udpWaitAny(pending, timeout - hedgeDelay, dmr);
   }
-  catch (const std::runtime_error &) {
-    // Parse error
-    throw SelectionFeedback(INVALID_ANSWER);
+
+  if(res == -1) {
+    d_numtimeouts++;
+    throw SelectionFeedback(TIMEOUT);
   }
-  if(dmr.dh.id != dmw.dh.id) {
+  if(res == -2)
+    throw SelectionFeedback(SOCKET);
+
+  winner = res;
+  checkResponse(dmr, pending[res].dmw.dh.id, prefix);
+  return dmr;
+}
+
+//! Sets up the header and EDNS of a query we are about to send, and counts it
+void TDNSResolver::setupQuery(DNSMessageWriter& dmw)
+{
+  bool doEDNS=true;
+
+  if(++d_numqueries > d_maxqueries) // there is the possibility our algorithm will loop
+    throw TooManyQueriesException(); // and send out thousands of queries, so let's not
+
+  dmw.dh.rd = false;
+  dmw.randomizeID();
+  if(doEDNS)   // 1500 byte buffer size, and only DNSSEC records if we need the NSECs
+    dmw.setEDNS(1500, g_nseccache.d_enabled);
+}
+
+//! Checks that dmr is an answer to the query with this id that we can use, throws SelectionFeedback if not
+void TDNSResolver::checkResponse(const DNSMessageReader& dmr, uint16_t id, const std::string& prefix)
+{
+  if(dmr.dh.id != id) {
     lstream() << prefix << "ID mismatch on answer" << endl;
     throw SelectionFeedback(INVALID_ANSWER);
   }
@@ -171,7 +175,6 @@ DNSMessageReader TDNSResolver::getResponse(const ComboAddress& server, const DNS
     lstream() << prefix <<"Got a truncated answer"<<endl;
     throw SelectionFeedback(TRUNCATED);
   }
-  return dmr;
 }
 
 
@@ -205,48 +208,62 @@ void TDNSResolver::dotDelegation(const DNSName& rrdn, const DNSName& server)
 
 /** This attempts to look up the name dn with type dt. The depth parameter is for
     trace output.
-    the 'auth' field describes the authority of the servers we will be talking to. Defaults to root ('believe everything')
-    The multimap specifies the servers to try with. Defaults to a list of
-    root-servers.
+    the 'startAuth' field describes the authority of the servers we will be talking to. If it is not passed,
+    we start at the deepest zone cut of dn we have cached nameservers for, which is the root ('believe everything')
+    if we know nothing yet. For DS, that is the deepest zone cut above dn.
+
+    With QNAME minimisation (RFC 9156), servers only get to see one label more than the zone they are
+    authoritative for, and a query for type A, until we reach the zone that has dn in it.
 */
 
-TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNSType& dt, int depth, const DNSName& auth)
+TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNSType& dt, int depth, const DNSName& startAuth)
 {
   std::string prefix(depth, ' ');
   prefix += dn.toString() + "|"+toString(dt)+" ";
 
   ResolveResult ret;
+  DNSName auth = startAuth;
+  if(auth.empty()) {
+    // the DS records of a zone live in its parent, the servers of the zone itself would say NODATA
+    DNSName cutOf(dn);
+    if(dt == DNSType::DS && !cutOf.empty())
+      cutOf.pop_front();
+    auth = get_closest_zonecut(cutOf);
+  }
+  if(startAuth.empty() && !auth.empty())
+    lstream() << prefix<<"Starting at cached zone cut "<<auth<<endl;
+
+  bool minimise = g_qnameMinimisation;
+  size_t minLabels = auth.size() + 1; // the number of labels of dn we send, when minimising
+  unsigned int minQueries = 0;
+
+  if(startAuth.empty() && g_nseccache.d_enabled) { // a new name, perhaps we already know it does not exist
+    auto neg = g_nseccache.lookup(dn, dt);
+    if(neg == NSECCache::Result::Nxdomain) {
+      lstream() << prefix<<"Cached NSEC records say this name does not exist"<<endl;
+      throw NxdomainException();
+    }
+    else if(neg == NSECCache::Result::Nodata) {
+      lstream() << prefix<<"Cached NSEC records say this type does not exist"<<endl;
+      throw NodataException();
+    }
+  }
 
   auto selection = Selection(auth, this);
   while(true) {
     transport choice = selection.get_transport();
 
     if (choice.address == NO_IP) {
-      // resolve choice.name as it is needed
-      for(const DNSType& qtype : {DNSType::A, DNSType::AAAA}) {
-        try {
-          auto result = resolveAt(choice.name, qtype, depth+1);
-          lstream() << prefix<<"Got "<<result.res.size()<<" nameserver " << qtype <<" addresses, adding to cache"<<endl;
-          for(const auto& res : result.res) {
-            save_to_cache(auth, choice.name, getIP(res.rr));
-          }
-        }
-        catch(std::exception& e)
-        {
-          lstream() << prefix <<"Failed to resolve name for "<<choice.name<<"|"<<qtype<<": "<<e.what()<<endl;
-
-          if(qtype == DNSType::A)
-            selection.error(choice, CANT_RESOLVE_A);
-          else
-            selection.error(choice, CANT_RESOLVE_AAAA);
-
-          continue;
-        }
-        catch(...)
-        {
-          lstream() << prefix <<"Failed to resolve name for "<<choice.name<<"|"<<qtype<<endl;
-          continue;
-        }
+      // resolve choice.name as it is needed. A and AAAA are looked up at the same time,
+      // in the background, and we carry on as soon as we know one address
+      double timeout = 1.0 * MAX_TIMEOUT / 1000000;
+      if(ns_resolver.wait_for_address(choice.name, timeout, *this, depth)) {
+        lstream() << prefix<<"Got nameserver addresses for "<<choice.name<<endl;
+      }
+      else {
+        lstream() << prefix <<"Failed to resolve name for "<<choice.name<<endl;
+        selection.error(choice, CANT_RESOLVE_A);
+        selection.error(choice, CANT_RESOLVE_AAAA);
       }
     } else {
       // send query to choice.address
@@ -256,27 +273,54 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
       try {
       lstream() << prefix<<"Sending to server "<<choice.name<<" on "<<choice.address.toString()<<endl;
 
+      // RFC 9156: ask for just one label below this zone, unless we've done that too often already
+      bool minimised = minimise && minLabels < dn.d_name.size() && minQueries < 10;
+      DNSName qname(dn);
+      while(minimised && qname.size() > minLabels)
+        qname.pop_front();
+      DNSType qtype = minimised ? DNSType::A : dt;
+      if(minimised)
+        lstream() << prefix<<"Minimised query for "<<qname<<"|"<<toString(qtype)<<endl;
+
       DNSMessageReader dmr;
       auto start = chrono::steady_clock::now();
       double timeout = 1.0 * choice.timeout / 1000000; // conversion to seconds
       cout << timeout << endl;
+      transport hedge;
+      bool doHedge = g_hedge && !choice.TCP && selection.get_hedge(choice, hedge);
+      int winner = 0;
+      bool hedged = false;
+      unsigned int sent = 1;
+      double hedgeDelay = 0;
       try {
-        dmr = getResponse(choice.address, dn, dt, timeout, choice.TCP, depth);
+        if(doHedge) {
+          hedge.address.sin4.sin_port = htons(53);
+          hedgeDelay = 1.0 * selection.hedge_delay(choice) / 1000000;
+          dmr = getResponseHedged(choice.address, hedge.address, qname, qtype, hedgeDelay, timeout, winner, hedged, depth);
+        }
+        else
+          dmr = getResponse(choice.address, qname, qtype, timeout, choice.TCP, depth, d_udptries, &sent);
         auto finish = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::microseconds>(finish-start);
+        auto duration = chrono::duration_cast<chrono::microseconds>(finish-start).count();
+        if(winner == 1) { // the hedge beat the server we picked first, which is still out there
+          lstream() << prefix << "Hedged query to "<<hedge.name<<" answered first"<<endl;
+          selection.overtaken(choice, duration);
+          std::swap(choice, hedge);
+          duration -= hedgeDelay * 1000000;
+        }
+        else if(hedged)
+          selection.overtaken(hedge, duration - hedgeDelay * 1000000);
         selection.success(choice);
-        selection.rtt(choice, duration.count());
+        if(sent == 1)  // after a retransmit, we don't know which query got answered
+          selection.rtt(choice, duration);
       }
       catch (SelectionFeedback e) {
-        auto finish = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::microseconds>(finish-start);
         cout << "============ error code " << e << endl;
-        selection.error(choice, e);
-        if (e != TIMEOUT && e != SOCKET) {
-          // selection.rtt(choice, 0); // some kind of error on socket or timeout, no point in reporting rtt
-        } else {
-          selection.rtt(choice, duration.count());
-        }
+        if(winner == 1) // the hedge answered, but not in a way we can use
+          std::swap(choice, hedge);
+        else if(hedged && e == TIMEOUT)
+          selection.error(hedge, e);
+        selection.error(choice, e); // a timeout backs off, but is not an RTT we can use
         continue;
       }
 
@@ -287,12 +331,34 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
 
       dmr.getQuestion(rrdn, rrdt); // parse into rrdn and rrdt
 
-      lstream() << prefix<<"Received a "<< dmr.size() << " byte response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<dn<<", qtype "<<dt<<", aa: "<<dmr.dh.aa << endl;
-      if(rrdn != dn || dt != rrdt) {
+      lstream() << prefix<<"Received a "<< dmr.size() << " byte response with RCode "<<(RCode)dmr.dh.rcode<<", qname " <<qname<<", qtype "<<qtype<<", aa: "<<dmr.dh.aa << endl;
+      if(rrdn != qname || qtype != rrdt) {
         lstream() << prefix << "Got a response to a different question or different type than we asked for!"<<endl;
         continue; // see if another server wants to work with us
       }
 
+      if(g_nseccache.d_enabled && dmr.dh.aa && ((RCode)dmr.dh.rcode == RCode::Nxdomain ||
+                                                ((RCode)dmr.dh.rcode == RCode::Noerror && !dmr.dh.ancount)))
+        harvestNSECs(dmr, auth, prefix); // a negative answer, with NSEC records for what does not exist
+
+      if(minimised) {
+        minQueries++;
+        if((RCode)dmr.dh.rcode == RCode::Nxdomain) { // nothing exists below a name that does not exist (RFC 8020)
+          lstream() << prefix<<"Got an Nxdomain for "<<qname<<", so "<<dn<<" does not exist either"<<endl;
+          throw NxdomainException();
+        }
+        else if((RCode)dmr.dh.rcode != RCode::Noerror) {
+          lstream() << prefix<<"Server does not like minimised queries, sending the full name"<<endl;
+          minimise = false;
+          continue;
+        }
+        else if(dmr.dh.aa) { // qname exists within this zone, so it is not a zone cut. Another label
+          minLabels++;
+          continue;
+        }
+        // otherwise this is a referral, which we process like any other
+      }
+
       // in a real resolver, you must ignore NXDOMAIN in case of a CNAME. Because that is how the internet rolls.
       if((RCode)dmr.dh.rcode == RCode::Nxdomain) {
         lstream() << prefix<<"Got an Nxdomain, it does not exist"<<endl;
@@ -328,10 +394,11 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
             if(target.isPartOf(auth)) { // this points to something we consider this server auth for
               lstream() << prefix << "target " << target << " is within " << auth<<", harvesting from packet"<<endl;
               bool hadMatch=false;      // perhaps the answer is in this DNS message
-              while(dmr.getRR(rrsection, rrdn, rrdt, ttl, rr)) {
-                if(rrsection==DNSSection::Answer && rrdn == target && rrdt == dt) {
+              DNSMessageReader::RRView view;
+              while(dmr.getRR(view)) {  // only decode what matches
+                if(view.section==DNSSection::Answer && view.type == dt && dmr.ownerIs(view, target)) {
                   hadMatch=true;
-                  ret.res.push_back({dn, ttl, std::move(rr)});
+                  ret.res.push_back({dn, view.ttl, dmr.getContent(view)});
                 }
               }
               if(hadMatch) {            // if it worked, great, otherwise actual chase
@@ -353,13 +420,15 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
           // this picks up nameserver records. We check if glue records are within the authority
           // of what we approached this server for.
           if(rrsection == DNSSection::Authority && rrdt == DNSType::NS) {
-            if(dn.isPartOf(rrdn))  {
+            if(!rrdn.isPartOf(auth) || rrdn == auth)
+              lstream()<< prefix << "Not accepting NS records for " << rrdn <<": not below "<<auth<<", the zone cut we asked"<<endl;
+            else if(dn.isPartOf(rrdn))  {
               DNSName nsname = dynamic_cast<NSGen*>(rr.get())->d_name;
 
               if(!dmr.dh.aa && (newAuth != rrdn || nsses.empty())) {
                 dotDelegation(rrdn, choice.name);
               }
-              save_to_cache(rrdn, nsname, NO_IP);
+              save_to_cache(rrdn, nsname, NO_IP, ttl);
               nsses.insert(nsname);
               newAuth = rrdn;
             }
@@ -371,7 +440,7 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
             // but that is ok: NS is in Authority section
             cout << "is" << rrdn << " part of " << auth << endl;
             if(rrdn.isPartOf(auth)) {
-              save_to_cache(newAuth, rrdn, getIP(rr));
+              save_address(rrdn, getIP(rr)); // the NS record put rrdn in the cache already
             }
             else
               lstream() << prefix << "Not accepting IP address of " << rrdn <<": out of authority of this server"<<endl;
@@ -406,19 +475,77 @@ TDNSResolver::ResolveResult TDNSResolver::resolveAt(const DNSName& dn, const DNS
   return ret;
 }
 
-//! This is a thread that will create an answer to the query in `dmr`
-void processQuery(int sock, ComboAddress client, DNSMessageReader dmr)
+/** Stores the NSEC records of a negative answer in the NSEC cache. These are only used for the zone
+    of the SOA record in the answer, which needs to be within auth, and live as long as the negative
+    answer would (RFC 9077) */
+void TDNSResolver::harvestNSECs(DNSMessageReader dmr, const DNSName& auth, const std::string& prefix)
+{
+  DNSMessageReader::RRView rr;
+  DNSName zone;
+  uint32_t negttl = 0;
+  vector<ResolveRR> nsecs;
+  bool haveSOA = false;
+
+  while(dmr.getRR(rr)) { // the RRSIGs are most of the message, and we skip them undecoded
+    if(rr.section != DNSSection::Authority)
+      continue;
+    if(rr.type == DNSType::SOA) {
+      DNSName rrdn = dmr.getOwner(rr);
+      if(!rrdn.isPartOf(auth))
+        continue;
+      zone = rrdn;
+      auto content = dmr.getContent(rr);
+      negttl = std::min(rr.ttl, dynamic_cast<SOAGen*>(content.get())->d_minimum);
+      haveSOA = true;
+    }
+    else if(rr.type == DNSType::NSEC)
+      nsecs.push_back({dmr.getOwner(rr), rr.ttl, dmr.getContent(rr)});
+  }
+  if(!haveSOA)
+    return;
+  for(const auto& nsec : nsecs) {
+    lstream() << prefix << "Caching NSEC " << nsec.name << " -> " << nsec.rr->toString() << endl;
+    g_nseccache.store(zone, nsec.name, *dynamic_cast<NSECGen*>(nsec.rr.get()), std::min(nsec.ttl, negttl));
+  }
+}
+
+//! This is a thread that refreshes a popular entry of the answer cache before it expires
+void prefetchAnswer(DNSName dn, DNSType dt)
 try
 {
-  DNSName dn;
-  DNSType dt;
-  dmr.getQuestion(dn, dt);
+  TDNSResolver tdr(g_root);
+  auto res = tdr.resolveAt(dn, dt);
+  cout<<"Prefetch of "<< dn <<"|"<<toString(dt)<<" took "<<tdr.d_numqueries <<" queries"<<endl;
+  if(res.res.empty())
+    g_answercache.prefetchFailed(dn, dt);
+  else
+    g_answercache.store(dn, dt, std::move(res));
+}
+catch(...)
+{
+  g_answercache.prefetchFailed(dn, dt);
+}
 
-  DNSMessageWriter dmw(dn, dt);
+//! Sets the header of a response to the query in dmr
+static void setupResponse(const DNSMessageReader& dmr, DNSMessageWriter& dmw)
+{
   dmw.dh.rd = dmr.dh.rd;
   dmw.dh.ra = true;
   dmw.dh.qr = true;
   dmw.dh.id = dmr.dh.id;
+}
+
+/** Resolves the query in dmr for a client, and stores the response packet in resp.
+    Returns false if resolution came up empty, in which case resp holds an empty answer.
+    If things go really wrong, like too many queries, this throws */
+bool resolveForClient(const DNSMessageReader& dmr, string& resp)
+{
+  DNSName dn;
+  DNSType dt;
+  dmr.getQuestion(dn, dt);
+
+  DNSMessageWriter dmw(dn, dt);
+  setupResponse(dmr, dmw);
 
   TDNSResolver::ResolveResult res;
   TDNSResolver tdr(g_root);
@@ -439,22 +566,141 @@ try
   catch(NodataException& nd)
   {
     cout<<"No Data for "<< dn <<"|"<<toString(dt)<<" took "<<tdr.d_numqueries <<" queries"<<endl;
-    SSendto(sock, dmw.serialize(), client);
-    return;
+    resp = dmw.serialize();
+    return true;
   }
   catch(NxdomainException& nx)
   {
     cout<<"NXDOMAIN for "<< dn <<"|"<<toString(dt)<<" took "<<tdr.d_numqueries <<" queries"<<endl;
     dmw.dh.rcode = (int)RCode::Nxdomain;
-    SSendto(sock, dmw.serialize(), client);
-    return;
+    resp = dmw.serialize();
+    return true;
   }
   // Put in the CNAME chain
   for(const auto& rr : res.intermediate)
     dmw.putRR(DNSSection::Answer, rr.name, rr.ttl, rr.rr);
   for(const auto& rr : res.res) // and the actual answer
     dmw.putRR(DNSSection::Answer, rr.name, rr.ttl, rr.rr);
-  string resp = dmw.serialize();
+  resp = dmw.serialize();
+  bool ret = !res.res.empty();
+  g_answercache.store(dn, dt, std::move(res));
+  return ret;
+}
+
+//! How long a client waits for a fresh answer before we hand out a stale one, if we have it
+std::chrono::milliseconds g_staleTimeout{1800};
+
+//! State shared between the clients asking for a name and the resolution happening on their behalf
+struct PendingResolution
+{
+  std::mutex lock;
+  std::condition_variable cond;
+  bool done{false};
+  bool ok{false};
+  string resp;
+};
+
+//! The resolutions processQueryStale has running, so clients asking for the same name|type share one
+static std::map<std::pair<DNSName, DNSType>, std::shared_ptr<PendingResolution>> g_pending;
+static std::mutex g_pendinglock;
+
+/** Serve-stale (RFC 8767) version of processQuery(). Resolution happens in a thread of its own,
+    unless one for this name and type is running already, in which case we wait for that one.
+    If it fails, or takes longer than g_staleTimeout, an expired answer from the cache is sent.
+    Resolution carries on in the background, and refreshes the cache once it is done. After a
+    failure, the expired answer is sent right away for a while, without resolving again */
+static void processQueryStale(int sock, const ComboAddress& client, const DNSMessageReader& dmr, DNSMessageWriter& dmw)
+{
+  if(g_answercache.getStaleFailed(dmw.d_qname, dmw.d_qtype, dmw)) {
+    cout<<"Answered "<< dmw.d_qname <<"|"<<toString(dmw.d_qtype)<<" from stale cache, refresh failed recently"<<endl;
+    SSendto(sock, dmw.serialize(), client);
+    return;
+  }
+
+  auto key = std::make_pair(dmw.d_qname, dmw.d_qtype);
+  std::shared_ptr<PendingResolution> pending;
+  {
+    std::lock_guard<std::mutex> l(g_pendinglock);
+    auto& running = g_pending[key];
+    if(!running) {
+      running = std::make_shared<PendingResolution>();
+      std::thread t([running, key, dmr]() {
+          string resp;
+          bool ok = false;
+          try {
+            ok = resolveForClient(dmr, resp);
+          }
+          catch(TooManyQueriesException& e) {
+            cerr << "Resolution died after too many queries" << endl;
+          }
+          catch(exception& e) {
+            cerr << "Resolution died: " << e.what() << endl;
+          }
+          if(!ok)
+            g_answercache.refreshFailed(key.first, key.second);
+          {
+            std::lock_guard<std::mutex> l(g_pendinglock);
+            g_pending.erase(key);
+          }
+          std::lock_guard<std::mutex> l(running->lock);
+          running->ok = ok;
+          running->resp = std::move(resp);
+          running->done = true;
+          running->cond.notify_all();
+        });
+      t.detach();
+    }
+    pending = running;
+  }
+
+  std::unique_lock<std::mutex> l(pending->lock);
+  pending->cond.wait_for(l, g_staleTimeout, [&pending]() { return pending->done; });
+  if(!pending->ok) {
+    l.unlock();
+    if(g_answercache.getStale(dmw.d_qname, dmw.d_qtype, dmw)) {
+      cout<<"Answered "<< dmw.d_qname <<"|"<<toString(dmw.d_qtype)<<" from stale cache"<<endl;
+      SSendto(sock, dmw.serialize(), client);
+      return;
+    }
+    l.lock();  // nothing stale either, so we'll have to wait after all
+    pending->cond.wait(l, [&pending]() { return pending->done; });
+  }
+  if(pending->resp.size() >= sizeof(dnsheader)) { // perhaps resolved for another client, so use our ID
+    string resp = pending->resp;
+    memcpy(&resp.at(0), &dmr.dh.id, sizeof(dmr.dh.id));
+    SSendto(sock, resp, client);
+  }
+}
+
+//! This is a thread that will create an answer to the query in `dmr`
+void processQuery(int sock, ComboAddress client, DNSMessageReader dmr)
+try
+{
+  DNSName dn;
+  DNSType dt;
+  dmr.getQuestion(dn, dt);
+
+  DNSMessageWriter dmw(dn, dt);
+  setupResponse(dmr, dmw);
+
+  auto status = g_answercache.get(dn, dt, dmw);
+  if(status != AnswerCache::Status::Miss) {
+    cout<<"Answered "<< dn <<"|"<<toString(dt)<<" from cache"<<endl;
+    SSendto(sock, dmw.serialize(), client);
+    if(status == AnswerCache::Status::HitNeedsPrefetch) { // popular, and about to expire
+      std::thread t(prefetchAnswer, dn, dt);
+      t.detach();
+    }
+    return;
+  }
+
+  if(g_answercache.d_stalewindow) {
+    processQueryStale(sock, client, dmr, dmw);
+    return;
+  }
+
+  string resp;
+  resolveForClient(dmr, resp);
   SSendto(sock, resp, client); // and send it!
 }
 catch(TooManyQueriesException& e)
@@ -481,15 +727,48 @@ static nlohmann::json rrToJSON(const TDNSResolver::ResolveRR& r)
 int main(int argc, char** argv)
 try
 {
+  // options come first, after that the positional arguments
+  int opts = 0;
+  for(; opts + 1 < argc && !strncmp(argv[opts + 1], "--", 2); ++opts) {
+    string opt(argv[opts + 1]);
+    if(opt.rfind("--serve-stale=", 0) == 0)
+      g_answercache.d_stalewindow = atoi(opt.c_str() + 14);
+    else if(opt.rfind("--stale-timeout=", 0) == 0)
+      g_staleTimeout = std::chrono::milliseconds(atoi(opt.c_str() + 16));
+    else if(opt.rfind("--stale-recheck=", 0) == 0)
+      g_answercache.d_stalerecheck = atoi(opt.c_str() + 16);
+    else if(opt == "--hedge")
+      g_hedge = true;
+    else if(opt == "--aggressive-nsec")
+      g_nseccache.d_enabled = true;
+    else if(opt == "--qname-minimisation")
+      g_qnameMinimisation = true;
+    else {
+      cerr<<"Unknown option "<<opt<<endl;
+      return(EXIT_FAILURE);
+    }
+  }
+  argc -= opts;
+  argv += opts;
+
   if(argc != 5 && argc != 6) {
-    cerr<<"Syntax: tres name type ip4_src ip6_src hintsfile\n";
-    cerr<<"Syntax: tres ip:port ip4_src ip6_src hintsfile\n";
+    cerr<<"Syntax: tres [options] name type ip4_src ip6_src hintsfile\n";
+    cerr<<"Syntax: tres [options] ip:port ip4_src ip6_src hintsfile\n";
     cerr<<"\n";
     cerr<<"When name and type are specified, tres looks up a DNS record.\n";
     cerr<<"types: A, NS, CNAME, SOA, PTR, MX, TXT, AAAA, ...\n";
     cerr<<"       see https://en.wikipedia.org/wiki/List_of_DNS_record_types\n";
     cerr<<"\n";
     cerr<<"When ip:port is specified, tres acts as a DNS server.\n";
+    cerr<<"\n";
+    cerr<<"Options:\n";
+    cerr<<"  --serve-stale=seconds  keep expired answers this long, and serve them\n";
+    cerr<<"                         if resolving fails or is slow (RFC 8767)\n";
+    cerr<<"  --stale-timeout=msec   how slow is slow, default 1800\n";
+    cerr<<"  --stale-recheck=sec    after a failed refresh, serve stale right away this long, default 30\n";
+    cerr<<"  --hedge                if a server is slow to answer, also ask the next best one\n";
+    cerr<<"  --aggressive-nsec      answer from cached NSEC records (RFC 8198), without validation!\n";
+    cerr<<"  --qname-minimisation   only send servers the part of the name they need (RFC 9156)\n";
     return(EXIT_FAILURE);
   }
   signal(SIGPIPE, SIG_IGN); // TCP, so we need this
@@ -498,6 +777,19 @@ try
   cout << "here" << endl;
   ip6_src = ComboAddress("["+(string) argv[argc-2]+"]:0");
 
+  g_udppool.setSource(ip4_src);
+  g_udppool.setSource(ip6_src);
+  g_tcppool.setSource(ip4_src);
+  g_tcppool.setSource(ip6_src);
+  for(int family : {AF_INET, AF_INET6}) {
+    try {
+      g_udppool.prefill(family, 16);
+    }
+    catch(std::exception& e) {
+      cerr<<"Unable to open upstream sockets for "<<(family == AF_INET ? "IPv4" : "IPv6")<<": "<<e.what()<<endl;
+    }
+  }
+
   multimap<DNSName, ComboAddress> hints;
 
   // Hacky way to load hints from file
@@ -8,11 +8,15 @@
 using namespace std;
 
 extern multimap<DNSName, ComboAddress> g_root;
+//! If a server is slow to answer, also ask another one, see TDNSResolver::getResponseHedged()
+extern bool g_hedge;
+//! Only send servers as much of the name as they need to know (RFC 9156)
+extern bool g_qnameMinimisation;
 
 
 /** Helper function that extracts a useable IP address from an
     A or AAAA resource record. Returns sin_family == 0 if it didn't work */
-static ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
+inline ComboAddress getIP(const std::unique_ptr<RRGen>& rr)
 {
   ComboAddress ret;
   ret.sin4.sin_family = 0;
@@ -57,7 +61,7 @@ public:
     }
   };
 
-  ResolveResult resolveAt(const DNSName& dn, const DNSType& dt, int depth=0, const DNSName& auth={});
+  ResolveResult resolveAt(const DNSName& dn, const DNSType& dt, int depth=0, const DNSName& startAuth={});
 
   void setPlot(ostream& fs)
   {
@@ -79,14 +83,19 @@ public:
   ~TDNSResolver()
   {
   }
-  DNSMessageReader getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, double timeout, bool doTCP = false, int depth=0);
+  DNSMessageReader getResponse(const ComboAddress& server, const DNSName& dn, const DNSType& dt, double timeout, bool doTCP = false, int depth=0, unsigned int tries=1, unsigned int* sent=nullptr);
+  DNSMessageReader getResponseHedged(const ComboAddress& server, const ComboAddress& hedge, const DNSName& dn, const DNSType& dt, double hedgeDelay, double timeout, int& winner, bool& hedged, int depth=0);
 private:
+  void setupQuery(DNSMessageWriter& dmw);
+  void checkResponse(const DNSMessageReader& dmr, uint16_t id, const std::string& prefix);
+  void harvestNSECs(DNSMessageReader dmr, const DNSName& auth, const std::string& prefix);
   void dotQuery(const DNSName& auth, const DNSName& server);
   void dotAnswer(const DNSName& dn, const DNSType& rrdt, const DNSName& server);
   void dotCNAME(const DNSName& target, const DNSName& server, const DNSName& dn);
   void dotDelegation(const DNSName& rrdn, const DNSName& server);
   multimap<DNSName, ComboAddress> d_root;
   unsigned int d_maxqueries{100};
+  unsigned int d_udptries{2}; //!< we send a UDP query this often to a server before giving up on it
 
   bool d_skipIPv6{false};
   ostream* d_dot{nullptr};
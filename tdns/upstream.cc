@@ -0,0 +1,355 @@
+#include "upstream.hh"
+#include <random>
+#include <chrono>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+UDPSocketPool g_udppool;
+
+void bindToRandomPort(int sock, const ComboAddress& src)
+{
+  static thread_local std::mt19937 gen{std::random_device{}()};
+  std::uniform_int_distribution<uint16_t> dis(1025, 65535);
+
+  ComboAddress local(src);
+  for(int tries = 0; ; ++tries) {
+    local.setPort(dis(gen));
+    try {
+      SBind(sock, local);
+      return;
+    }
+    catch(std::exception& e) {
+      if(tries == 10)   // port might be in use, but not 10 times in a row
+        throw;
+    }
+  }
+}
+
+UDPLease::~UDPLease()
+{
+  if(!d_ps)   // we got moved from
+    return;
+  if(d_burn)
+    d_ps.reset();
+  else
+    d_pool.release(std::move(d_ps));
+}
+
+void UDPSocketPool::setSource(const ComboAddress& src)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  if(src.isIPv4())
+    d_src4 = src;
+  else
+    d_src6 = src;
+}
+
+std::unique_ptr<PooledSocket> UDPSocketPool::makeSocket(int family)
+{
+  auto ret = std::make_unique<PooledSocket>(family);
+  bindToRandomPort(ret->sock, family == AF_INET ? d_src4 : d_src6);
+  return ret;
+}
+
+void UDPSocketPool::prefill(int family, unsigned int n)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& pool = idle(family);
+  while(pool.size() < n && pool.size() < d_maxidle)
+    pool.push_back(makeSocket(family));
+}
+
+UDPLease UDPSocketPool::acquire(int family)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& pool = idle(family);
+  time_t now = time(nullptr);
+  while(!pool.empty()) {
+    auto ps = std::move(pool.back());
+    pool.pop_back();
+    if(expired(*ps, now))  // rotate to a fresh port
+      continue;
+    ps->uses++;
+    return UDPLease(*this, std::move(ps));
+  }
+  auto ps = makeSocket(family);
+  ps->uses++;
+  return UDPLease(*this, std::move(ps));
+}
+
+void UDPSocketPool::release(std::unique_ptr<PooledSocket>&& ps)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& pool = idle(ps->family);
+  if(expired(*ps, time(nullptr)) || pool.size() >= d_maxidle)
+    return; // closes the socket
+  pool.push_back(std::move(ps));
+}
+
+void udpSend(UDPPending& p)
+{
+  SSendto(p.sock, p.dmw.serialize(), p.server);
+}
+
+int udpWaitAny(std::vector<UDPPending>& pending, double timeout, DNSMessageReader& dmr)
+{
+  auto deadline = chrono::steady_clock::now() + chrono::microseconds((int64_t)(timeout * 1000000));
+  std::vector<struct pollfd> pfds(pending.size());
+  for(;;) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+    if(left < 0)
+      return -1;
+    for(size_t n = 0; n < pending.size(); ++n) {
+      pfds[n].fd = pending[n].sock;
+      pfds[n].events = POLLIN;
+      pfds[n].revents = 0;
+    }
+    int res = poll(pfds.data(), pfds.size(), left);
+    if(res < 0) {
+      if(errno == EINTR)
+        continue;
+      for(auto& p : pending)
+        p.sock.burn();
+      return -2;
+    }
+    if(!res)
+      return -1;
+
+    for(size_t n = 0; n < pending.size(); ++n) {
+      if(!(pfds[n].revents & POLLIN))
+        continue;
+      auto& p = pending[n];
+      ComboAddress from(p.server);
+      string resp = SRecvfrom(p.sock, 65535, from);
+      if(from != p.server) // wrong address or port
+        continue;
+      try {
+        DNSMessageReader cand(resp);
+        DNSName qname;
+        DNSType qtype;
+        cand.getQuestion(qname, qtype);
+        if(cand.dh.id != p.dmw.dh.id || qname != p.dmw.d_qname || qtype != p.dmw.d_qtype)
+          continue;   // late answer to a previous query, or a spoofing attempt
+        dmr = std::move(cand);
+        return n;
+      }
+      catch(std::exception& e) { // unparseable, could still be followed by the real answer
+        continue;
+      }
+    }
+  }
+}
+
+int udpExchange(UDPLease& sock, const ComboAddress& server, DNSMessageWriter& dmw, double timeout, DNSMessageReader& dmr, unsigned int tries, unsigned int* sent)
+{
+  std::vector<UDPPending> pending{{sock, server, dmw}};
+  for(unsigned int n = 0; n < std::max(tries, 1U); ++n) {
+    udpSend(pending[0]);  // the same socket and ID, so a late answer to an earlier send is fine too
+    if(sent)
+      *sent = n + 1;
+    int res = udpWaitAny(pending, timeout, dmr);
+    if(res == 0)
+      return 1;
+    if(res == -2)
+      return -1;
+  }
+  return 0;
+}
+
+TCPConnectionPool g_tcppool;
+
+TCPUpstream::TCPUpstream(const ComboAddress& server, const ComboAddress& src) : d_sock(server.sin4.sin_family, SOCK_STREAM), d_lastused(time(nullptr))
+{
+  bindToRandomPort(d_sock, src);
+  SConnect(d_sock, server);
+}
+
+void TCPUpstream::fail()
+{
+  d_dead = true;
+  d_cond.notify_all();
+}
+
+/* Reads whatever the server has sent us, waiting at most msec. Called with the lock held,
+   but unlocks it while waiting for the socket. Complete answers are filed by ID.
+   Returns false if the connection is broken */
+bool TCPUpstream::readAnswers(std::unique_lock<std::mutex>& l, int msec)
+{
+  l.unlock();
+  struct pollfd pfd;
+  pfd.fd = d_sock;
+  pfd.events = POLLIN;
+  int res = poll(&pfd, 1, msec);
+  int err = errno;
+  char buf[4096];
+  ssize_t got = 0;
+  if(res > 0)
+    got = read(d_sock, buf, sizeof(buf));
+  l.lock();
+
+  if(res < 0)
+    return err == EINTR;
+  if(!res)  // timeout, nothing wrong with the connection
+    return true;
+  if(got <= 0) // EOF, the server closed on us, or an error
+    return false;
+
+  d_readbuf.append(buf, got);
+  while(d_readbuf.size() >= 2) {
+    uint16_t len;
+    memcpy(&len, d_readbuf.c_str(), 2);
+    len = ntohs(len);
+    if(d_readbuf.size() < 2 + (size_t)len)
+      break;
+    string msg = d_readbuf.substr(2, len);
+    d_readbuf.erase(0, 2 + len);
+    if(len < sizeof(dnsheader))
+      continue;
+    uint16_t id;
+    memcpy(&id, msg.c_str(), 2);
+    if(d_outstanding.count(id)) // otherwise this is a late answer to a query that timed out
+      d_answers[id] = std::move(msg);
+  }
+  return true;
+}
+
+int TCPUpstream::exchange(DNSMessageWriter& dmw, double timeout, DNSMessageReader& dmr)
+{
+  auto deadline = chrono::steady_clock::now() + chrono::microseconds((int64_t)(timeout * 1000000));
+  std::unique_lock<std::mutex> l(d_lock);
+  if(d_dead)
+    return -1;
+
+  while(d_outstanding.count(dmw.dh.id)) // the ID is how we find our answer, so it must be unique
+    dmw.randomizeID();
+  uint16_t id = dmw.dh.id;
+
+  string ser = "00" + dmw.serialize();
+  uint16_t len = htons(ser.length() - 2);
+  memcpy(&ser.at(0), &len, 2);
+  try {
+    SWriten(d_sock, ser);
+  }
+  catch(std::exception& e) {
+    fail();
+    return -1;
+  }
+  d_outstanding.insert(id);
+  d_queries++;
+  d_lastused = time(nullptr);
+
+  int ret = 0;
+  string resp;
+  for(;;) {
+    auto iter = d_answers.find(id);
+    if(iter != d_answers.end()) {
+      resp = std::move(iter->second);
+      d_answers.erase(iter);
+      ret = 1;
+      break;
+    }
+    if(d_dead) {
+      ret = -1;
+      break;
+    }
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+    if(left <= 0)
+      break;
+
+    if(!d_reading) { // nobody is reading, so we do it, for everyone
+      d_reading = true;
+      bool ok = readAnswers(l, left);
+      d_reading = false;
+      d_cond.notify_all();
+      if(!ok)
+        fail();
+    }
+    else
+      d_cond.wait_until(l, deadline);
+  }
+  d_outstanding.erase(id);
+  d_lastused = time(nullptr);
+  l.unlock();
+
+  if(ret == 1)
+    dmr = DNSMessageReader(resp);
+  return ret;
+}
+
+bool TCPUpstream::expired(time_t now, time_t idletimeout)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_dead || (d_outstanding.empty() && now - d_lastused >= idletimeout);
+}
+
+size_t TCPUpstream::outstanding()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_outstanding.size();
+}
+
+unsigned int TCPUpstream::queries()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_queries;
+}
+
+void TCPConnectionPool::setSource(const ComboAddress& src)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  if(src.isIPv4())
+    d_src4 = src;
+  else
+    d_src6 = src;
+}
+
+std::shared_ptr<TCPUpstream> TCPConnectionPool::get(const ComboAddress& server)
+{
+  ComboAddress src;
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    time_t now = time(nullptr);
+    for(auto iter = d_conns.begin(); iter != d_conns.end(); ) { // close idle and broken connections
+      auto& conns = iter->second;
+      conns.erase(remove_if(conns.begin(), conns.end(), [this,now](const auto& c) { return c->expired(now, d_idletimeout); }), conns.end());
+      if(conns.empty())
+        iter = d_conns.erase(iter);
+      else
+        ++iter;
+    }
+
+    for(const auto& c : d_conns[server]) {
+      if(c->outstanding() < d_maxoutstanding)
+        return c;
+    }
+    src = server.isIPv4() ? d_src4 : d_src6;
+  }
+
+  // connecting takes a while, so we don't hold the lock for it
+  auto conn = std::make_shared<TCPUpstream>(server, src);
+  std::lock_guard<std::mutex> l(d_lock);
+  d_conns[server].push_back(conn);
+  return conn;
+}
+
+int tcpExchange(const ComboAddress& server, DNSMessageWriter& dmw, double timeout, DNSMessageReader& dmr)
+{
+  for(int attempt = 0; ; ++attempt) {
+    std::shared_ptr<TCPUpstream> conn;
+    try {
+      conn = g_tcppool.get(server);
+    }
+    catch(std::exception& e) { // could not connect
+      return -1;
+    }
+    bool reused = conn->queries() > 0;
+    int res = conn->exchange(dmw, timeout, dmr);
+    if(res < 0 && reused && !attempt) // server may have closed an idle connection on us
+      continue;
+    return res;
+  }
+}
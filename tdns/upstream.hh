@@ -0,0 +1,172 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <map>
+#include <set>
+#include <ctime>
+#include "sclasses.hh"
+#include "record-types.hh"
+
+/*!
+   @file
+   @brief Sockets tres uses to talk to authoritative servers
+
+   Creating, binding and connecting a socket for every query costs several
+   system calls, and picking source ports sequentially makes it easy for an
+   attacker to guess them. Instead, tres keeps a pool of UDP sockets that
+   are bound to random source ports. Each socket is retired after a while,
+   so the source ports tres uses rotate over time.
+
+   A pooled socket is not connected, which means anyone can send us a packet
+   on it. So answers are only accepted if they come from the server we asked,
+   from port 53, with the ID we sent and for the question we asked.
+
+   Over TCP, setting up a connection costs a round trip, so tres keeps
+   connections to authoritative servers open for a while. Multiple queries
+   can be outstanding on one connection, and answers are matched to their
+   queries by ID, in whatever order they arrive.
+*/
+
+//! Binds sock to a random port on src, for unpredictable source ports
+void bindToRandomPort(int sock, const ComboAddress& src);
+
+//! A UDP socket that lives in the UDPSocketPool
+struct PooledSocket
+{
+  PooledSocket(int family_) : family(family_), sock(family, SOCK_DGRAM), created(time(nullptr)) {}
+  int family;
+  Socket sock;
+  time_t created;
+  unsigned int uses{0};
+};
+
+class UDPSocketPool;
+
+//! Hands out a PooledSocket for exclusive use, returns it to the pool on destruction
+class UDPLease
+{
+public:
+  UDPLease(UDPSocketPool& pool, std::unique_ptr<PooledSocket>&& ps) : d_pool(pool), d_ps(std::move(ps)) {}
+  UDPLease(const UDPLease&) = delete;
+  UDPLease(UDPLease&& rhs) : d_pool(rhs.d_pool), d_ps(std::move(rhs.d_ps)), d_burn(rhs.d_burn) {}
+  ~UDPLease();
+  operator int() const { return d_ps->sock; }
+  //! Make sure this socket is closed instead of returned to the pool, for example after an error
+  void burn() { d_burn = true; }
+private:
+  UDPSocketPool& d_pool;
+  std::unique_ptr<PooledSocket> d_ps;
+  bool d_burn{false};
+};
+
+//! A pool of pre-opened UDP sockets with random source ports, shared by all resolutions
+class UDPSocketPool
+{
+public:
+  //! Set the address our sockets bind to, the port is ignored
+  void setSource(const ComboAddress& src);
+  //! Open n sockets of this family in advance
+  void prefill(int family, unsigned int n);
+  UDPLease acquire(int family);
+  void release(std::unique_ptr<PooledSocket>&& ps);
+
+  unsigned int d_maxuses{256}; //!< a socket is retired after this many queries
+  time_t d_maxage{60};         //!< or after this many seconds
+  size_t d_maxidle{128};       //!< we keep at most this many idle sockets per family
+private:
+  std::unique_ptr<PooledSocket> makeSocket(int family);
+  bool expired(const PooledSocket& ps, time_t now) const
+  {
+    return ps.uses >= d_maxuses || now - ps.created >= d_maxage;
+  }
+  std::vector<std::unique_ptr<PooledSocket>>& idle(int family)
+  {
+    return family == AF_INET ? d_idle4 : d_idle6;
+  }
+  std::mutex d_lock;
+  std::vector<std::unique_ptr<PooledSocket>> d_idle4, d_idle6;
+  ComboAddress d_src4{"0.0.0.0"}, d_src6{"::"};
+};
+
+extern UDPSocketPool g_udppool;
+
+//! A query sent over a pooled socket, for which we are waiting for an answer
+struct UDPPending
+{
+  UDPLease& sock;
+  const ComboAddress& server;
+  DNSMessageWriter& dmw;
+};
+
+//! Sends the query of p
+void udpSend(UDPPending& p);
+
+/** Waits for the first matching answer to any of the pending queries, for at most timeout seconds.
+    Returns the index of the query that got answered, with the answer in dmr, -1 on a timeout and
+    -2 on a socket error. Used to have queries to several servers in flight at the same time */
+int udpWaitAny(std::vector<UDPPending>& pending, double timeout, DNSMessageReader& dmr);
+
+/** Sends the query in dmw to server over a pooled socket, and waits for a matching answer.
+    Anything that does not come from server, or does not have the ID, qname and qtype
+    of dmw is ignored, and we keep on waiting. Returns 1 with the answer in dmr, 0 on a timeout
+    and -1 on a socket error, just like waitForData().
+
+    If there is no answer after timeout seconds, the query is sent again, up to 'tries' times in
+    total. Retransmits go out over the same socket with the same ID, so an answer to any of them
+    will do. 'sent' is set to the number of times we sent the query: if that is more than one, we
+    can't tell which one got answered, so the time it took is not a useful RTT (Karn's algorithm) */
+int udpExchange(UDPLease& sock, const ComboAddress& server, DNSMessageWriter& dmw, double timeout, DNSMessageReader& dmr, unsigned int tries = 1, unsigned int* sent = nullptr);
+
+//! A TCP connection to an authoritative server, on which several queries can be outstanding
+class TCPUpstream
+{
+public:
+  TCPUpstream(const ComboAddress& server, const ComboAddress& src);
+  //! Sends dmw, waits for the answer with its ID. Returns 1 with answer in dmr, 0 on timeout, -1 if the connection broke
+  int exchange(DNSMessageWriter& dmw, double timeout, DNSMessageReader& dmr);
+
+  //! Is this connection broken, or idle for longer than idletimeout?
+  bool expired(time_t now, time_t idletimeout);
+  size_t outstanding();   //!< number of queries in flight
+  unsigned int queries(); //!< number of queries sent over this connection so far
+private:
+  bool readAnswers(std::unique_lock<std::mutex>& l, int msec);
+  void fail();
+  Socket d_sock;
+  std::mutex d_lock;
+  std::condition_variable d_cond;
+  std::set<uint16_t> d_outstanding;          //!< IDs of queries in flight
+  std::map<uint16_t, std::string> d_answers; //!< answers that are in, but not yet picked up
+  std::string d_readbuf;                     //!< partially received answers
+  bool d_reading{false};                     //!< is a thread reading from the socket
+  bool d_dead{false};
+  unsigned int d_queries{0};
+  time_t d_lastused;
+};
+
+//! Keeps TCP connections to authoritative servers open for reuse
+class TCPConnectionPool
+{
+public:
+  void setSource(const ComboAddress& src);
+  //! Finds a usable connection to server, or makes a new one
+  std::shared_ptr<TCPUpstream> get(const ComboAddress& server);
+
+  time_t d_idletimeout{10};          //!< connections idle for this long are closed
+  unsigned int d_maxoutstanding{16}; //!< beyond this many queries in flight, open another connection
+private:
+  std::mutex d_lock;
+  std::map<ComboAddress, std::vector<std::shared_ptr<TCPUpstream>>> d_conns;
+  ComboAddress d_src4{"0.0.0.0"}, d_src6{"::"};
+};
+
+extern TCPConnectionPool g_tcppool;
+
+/** Sends the query in dmw to server over a pooled TCP connection, and waits for its answer.
+    If a reused connection turns out to be closed by the server, we retry once on a new one.
+    Returns 1 with the answer in dmr, 0 on a timeout and -1 on a connection error.
+    Throws if the answer can't be parsed */
+int tcpExchange(const ComboAddress& server, DNSMessageWriter& dmw, double timeout, DNSMessageReader& dmr);